@@ -0,0 +1,62 @@
+/*
+  Part of SubseqSketch.
+  A blocking queue with bounded capacity for connecting pipeline stages.
+  By Ke @ Penn State
+*/
+
+#ifndef __BOUNDED_QUEUE_H__
+#define __BOUNDED_QUEUE_H__
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+template<typename T>
+class bounded_queue
+{
+public:
+    bounded_queue(std::size_t capacity)
+	: capacity(capacity), closed(false)
+    {}
+
+    // Block until there is room in the queue, then append x.
+    void push(T&& x)
+    {
+	std::unique_lock<std::mutex> lock(mtx);
+	not_full.wait(lock, [this]{ return items.size() < capacity; });
+	items.push_back(std::move(x));
+	not_empty.notify_one();
+    }
+
+    // Block until an item is available and move it to x. Return false if
+    // the queue is closed and there are no more items.
+    bool pop(T& x)
+    {
+	std::unique_lock<std::mutex> lock(mtx);
+	not_empty.wait(lock, [this]{ return !items.empty() || closed; });
+	if(items.empty()) return false;
+
+	x = std::move(items.front());
+	items.pop_front();
+	not_full.notify_one();
+	return true;
+    }
+
+    // No more items will be pushed.
+    void close()
+    {
+	std::lock_guard<std::mutex> lock(mtx);
+	closed = true;
+	not_empty.notify_all();
+    }
+
+private:
+    std::size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mtx;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+#endif
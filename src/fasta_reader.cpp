@@ -1,16 +1,23 @@
 /*
   Part of SubseqSketch.
-  A naive fasta reader.
+  A naive fasta/fastq reader.
   By Ke @ Penn State
 */
 
 #include "fasta_reader.hpp"
+#include <cstring>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 fasta_reader::fasta_reader(const std::string& file)
-    : fin(file)
+    : file_data(nullptr), file_size(0), mapped(false), fastq(false),
+      data(nullptr), size(0), pos(0)
 {
-    if(!fin)
+    int fd = open(file.c_str(), O_RDONLY);
+    if(fd < 0)
     {
 	// throw std::runtime_error("Could not open the file: " + file);
 	std::cerr << "Error: could not open the file: "
@@ -18,12 +25,47 @@ fasta_reader::fasta_reader(const std::string& file)
 	std::exit(1);
     }
 
-    int header = fin.peek();
-    if(header != '>')
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
     {
-	// throw std::runtime_error(file + " does not appear to be a valid fasta file");
+	void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(p != MAP_FAILED)
+	{
+	    madvise(p, st.st_size, MADV_SEQUENTIAL);
+	    file_data = static_cast<const char*>(p);
+	    file_size = st.st_size;
+	    mapped = true;
+	}
+    }
+
+    if(!mapped)
+    {
+	// not a regular file or cannot be mapped, read all at once
+	std::ifstream fin(file, std::ios::binary);
+	std::ostringstream oss;
+	oss << fin.rdbuf();
+	file_content = oss.str();
+	file_data = file_content.data();
+	file_size = file_content.size();
+    }
+    close(fd);
+
+    if(gzip_stream::is_gzip(file_data, file_size))
+    {
+	gz.reset(new gzip_stream(file_data, file_size));
+    }
+    else
+    {
+	data = file_data;
+	size = file_size;
+    }
+
+    fastq = !eof() && data[pos] == '@';
+    if(eof() || (data[pos] != '>' && !fastq))
+    {
+	// throw std::runtime_error(file + " does not appear to be a valid fasta/fastq file");
 	std::cerr << "Error: " << file
-		  << " does not appear to be a valid fasta file"
+		  << " does not appear to be a valid fasta/fastq file"
 		  << std::endl;
 	std::exit(1);
     }
@@ -31,33 +73,149 @@ fasta_reader::fasta_reader(const std::string& file)
 
 fasta_reader::~fasta_reader()
 {
-    fin.close();
+    if(mapped)
+    {
+	munmap(const_cast<char*>(file_data), file_size);
+    }
 }
 
 bool fasta_reader::eof()
 {
-    return fin.eof();
+    return !available(pos);
 }
 
-std::string fasta_reader::next()
+bool fasta_reader::available(std::size_t p)
+{
+    while(p >= size)
+    {
+	if(!fill()) return false;
+    }
+    return true;
+}
+
+bool fasta_reader::fill()
+{
+    if(!gz) return false;
+
+    bool more = gz->read(content);
+    data = content.data();
+    size = content.size();
+    return more;
+}
+
+std::size_t fasta_reader::find(char c, std::size_t from)
+{
+    while(true)
+    {
+	const char* p = static_cast<const char*>(memchr(data + from, c, size - from));
+	if(p) return p - data;
+
+	from = size;
+	if(!fill()) return size;
+    }
+}
+
+void fasta_reader::next_record(std::size_t& st, std::size_t& ed)
 {
     assert(!eof());
-#ifndef NDEBUG
-    char header = fin.peek();
-    assert(header == '>');
-#endif
+    assert(data[pos] == (fastq ? '@' : '>'));
+
+    // drop the decompressed text already read once it is the larger part
+    if(gz && pos > size / 2)
+    {
+	content.erase(0, pos);
+	data = content.data();
+	size = content.size();
+	pos = 0;
+    }
 
     // ignore the assumed header line
-    fin.ignore(MAX_SIZE, '\n');
-    std::string line;
-    std::ostringstream oss;
-    
-    while(fin.peek() != '>' && std::getline(fin, line))
+    std::size_t nl = find('\n', pos);
+    st = nl < size ? nl + 1 : size;
+
+    if(fastq)
     {
-	oss << line;
+	// the sequence line is followed by a '+' line and a quality line
+	ed = find('\n', st);
+	std::size_t plus = ed < size ? ed + 1 : size;
+	if(!available(plus) || data[plus] != '+')
+	{
+	    std::cerr << "Error: invalid fastq record, expecting a '+' line after: "
+		      << std::string(data + pos, nl - pos) << std::endl;
+	    std::exit(1);
+	}
+	nl = find('\n', plus);
+	nl = nl < size ? find('\n', nl + 1) : size;
+	pos = nl < size ? nl + 1 : size;
+
+	// skip empty lines between records
+	while(!eof() && data[pos] == '\n') ++pos;
+	if(!eof() && data[pos] != '@')
+	{
+	    std::cerr << "Error: invalid fastq record, expecting '@' at the start of a record"
+		      << std::endl;
+	    std::exit(1);
+	}
+	return;
     }
 
-    return oss.str();
+    // the record ends at the next '>' starting a line
+    ed = st;
+    while(true)
+    {
+	ed = find('>', ed);
+	if(ed >= size || data[ed - 1] == '\n') break;
+	++ed;
+    }
+
+    pos = ed;
+}
+
+seq_view fasta_reader::next_view()
+{
+    std::size_t st, ed;
+    next_record(st, ed);
+
+    // drop the line breaks, sequences on a single line are not copied
+    const char* nl = static_cast<const char*>(memchr(data + st, '\n', ed - st));
+    if(!nl || nl == data + ed - 1)
+    {
+	return {data + st, static_cast<std::size_t>((nl ? nl : data + ed) - (data + st))};
+    }
+
+    buffer.clear();
+    while(nl)
+    {
+	buffer.append(data + st, nl - (data + st));
+	st = nl - data + 1;
+	nl = static_cast<const char*>(memchr(data + st, '\n', ed - st));
+    }
+    buffer.append(data + st, ed - st);
+
+    return {buffer.data(), buffer.size()};
+}
+
+void fasta_reader::next_packed(const int* codes, packed_sequence& seq)
+{
+    std::size_t st, ed;
+    next_record(st, ed);
+
+    // the text of the record bounds the number of characters
+    seq.clear();
+    seq.reserve(ed - st);
+    while(st < ed)
+    {
+	const char* nl = static_cast<const char*>(memchr(data + st, '\n', ed - st));
+	std::size_t line_end = nl ? nl - data : ed;
+	seq.append(data + st, line_end - st, codes);
+	st = line_end + 1;
+    }
+}
+
+std::string fasta_reader::next()
+{
+    seq_view seq = next_view();
+    return std::string(seq.data, seq.size);
 }
 
 void fasta_reader::read_all(std::vector<std::string>& seqs)
@@ -1,6 +1,6 @@
 /*
   Part of SubseqSketch.
-  A naive fasta reader.
+  A naive fasta/fastq reader.
   By Ke @ Penn State
 */
 
@@ -13,9 +13,26 @@
 #include <iostream>
 #include <cassert>
 #include <vector>
+#include <memory>
+#include "gzip_stream.hpp"
+#include "packed_sequence.hpp"
 
 constexpr auto MAX_SIZE = std::numeric_limits<std::streamsize>::max();
 
+// A read-only view of a sequence owned by someone else.
+struct seq_view
+{
+    const char* data;
+    std::size_t size;
+};
+
+// The file is memory-mapped (or read into memory at once if it cannot be
+// mapped) and scanned with memchr, sequences are handed out as views into
+// the mapping whenever they are stored on a single line. Gzip (and BGZF)
+// compressed files are detected and decompressed on the fly, only the
+// part of the decompressed text that has not been read is kept. Files
+// starting with '@' are read as fastq with 4 lines per record, sequences
+// are returned as views and quality lines are skipped.
 class fasta_reader
 {
 public:
@@ -26,12 +43,52 @@ public:
     // Read the next sequence in file. A sequence is assumed to be preceded by
     // a header line starts with '>', the header line is then ignored. Following
     // lines until the next header or eof are concatenated and returned.
+    // For fastq, the second line of each record is returned.
     std::string next();
 
+    // Same as next() but without copying a sequence stored on a single line.
+    // Sequences spanning multiple lines are concatenated in a buffer reused
+    // by the reader. The view is valid until the next call to next_view().
+    seq_view next_view();
+
+    // Same as next() but the sequence is packed into seq line by line
+    // without copying the text, codes is as in packed_sequence::append.
+    void next_packed(const int* codes, packed_sequence& seq);
+
     void read_all(std::vector<std::string>& seqs);
     
 private:
-    std::ifstream fin;
+    // The input file, either mapped or read into file_content.
+    const char* file_data;
+    std::size_t file_size;
+    bool mapped;
+    std::string file_content;
+
+    // Decompressor of a gzip input file, null for plain text.
+    std::unique_ptr<gzip_stream> gz;
+    // Decompressed text not read yet.
+    std::string content;
+
+    bool fastq;
+
+    // Text being parsed, the input file itself or content.
+    const char* data;
+    std::size_t size;
+    std::size_t pos;
+    std::string buffer;
+
+    // Decompress more text of a gzip file, return false if there is no more.
+    bool fill();
+    // Whether position p of the text exists, decompress more text if needed.
+    bool available(std::size_t p);
+    // Return the position of the first c in the text from position from,
+    // decompress more text if needed, return size if not found.
+    std::size_t find(char c, std::size_t from);
+
+    // Skip the header line at pos, return the range [st, ed) of the
+    // following sequence lines and move pos to the next header.
+    // For fastq, also skip the '+' and quality lines.
+    void next_record(std::size_t& st, std::size_t& ed);
 };
 
 #endif
@@ -0,0 +1,547 @@
+/*
+  Part of SubseqSketch.
+  Decompression of gzip (including BGZF) files held in memory.
+  By Ke @ Penn State
+*/
+
+#include "gzip_stream.hpp"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <omp.h>
+
+namespace
+{
+// Raised while decoding and caught by gzip_stream::read, which reports it
+// and exits from the calling thread, never from an OpenMP worker.
+struct corrupt_input
+{
+    const char* reason;
+};
+
+void corrupted(const char* reason)
+{
+    throw corrupt_input{reason};
+}
+
+void exit_corrupted(const char* reason)
+{
+    // throw std::runtime_error(std::string("Corrupted gzip input: ") + reason);
+    std::cerr << "Error: corrupted gzip input, " << reason << std::endl;
+    std::exit(1);
+}
+
+// BGZF blocks are decoded by a few threads only, the input is read while
+// the sketching threads are busy.
+const int max_bgzf_threads = 4;
+
+uint32_t read_le(const uint8_t* p, int bytes)
+{
+    uint32_t x = 0;
+    for(int i = bytes - 1; i >= 0; --i) x = (x << 8) | p[i];
+    return x;
+}
+
+// Canonical Huffman code of a deflate block. Codes of at most FAST_BITS
+// bits are decoded by one lookup in fast, longer codes bit by bit.
+const int MAX_BITS = 15;
+const int FAST_BITS = 10;
+
+struct huffman
+{
+    int16_t count[MAX_BITS + 1];
+    int16_t symbol[288];
+    // indexed by the next FAST_BITS input bits, (length << 9) | symbol,
+    // 0 if the code is longer than FAST_BITS
+    uint16_t fast[1 << FAST_BITS];
+
+    void build(const uint8_t* lengths, int n)
+    {
+	std::memset(count, 0, sizeof(count));
+	for(int i = 0; i < n; ++i) ++count[lengths[i]];
+
+	int left = 1;
+	for(int len = 1; len <= MAX_BITS; ++len)
+	{
+	    left = (left << 1) - count[len];
+	    if(left < 0) corrupted("over-subscribed Huffman code");
+	}
+
+	int16_t offs[MAX_BITS + 2];
+	offs[1] = 0;
+	for(int len = 1; len <= MAX_BITS; ++len) offs[len + 1] = offs[len] + count[len];
+	for(int i = 0; i < n; ++i)
+	{
+	    if(lengths[i] != 0) symbol[offs[lengths[i]]++] = i;
+	}
+
+	// codes are stored bit-reversed in the input
+	std::memset(fast, 0, sizeof(fast));
+	int code = 0;
+	int idx = 0;
+	for(int len = 1; len <= FAST_BITS; ++len)
+	{
+	    for(int i = 0; i < count[len]; ++i, ++code, ++idx)
+	    {
+		int rev = 0;
+		for(int b = 0; b < len; ++b) rev |= ((code >> b) & 1) << (len - 1 - b);
+		for(int k = rev; k < (1 << FAST_BITS); k += 1 << len)
+		{
+		    fast[k] = (len << 9) | symbol[idx];
+		}
+	    }
+	    code <<= 1;
+	}
+    }
+};
+
+const int16_t len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int16_t len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			       3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int16_t dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			       257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+			       8193, 12289, 16385, 24577};
+const int16_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+				7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+struct fixed_codes
+{
+    huffman lit;
+    huffman dist;
+
+    fixed_codes()
+    {
+	uint8_t lengths[288];
+	int i = 0;
+	for(; i < 144; ++i) lengths[i] = 8;
+	for(; i < 256; ++i) lengths[i] = 9;
+	for(; i < 280; ++i) lengths[i] = 7;
+	for(; i < 288; ++i) lengths[i] = 8;
+	lit.build(lengths, 288);
+
+	for(i = 0; i < 30; ++i) lengths[i] = 5;
+	dist.build(lengths, 30);
+    }
+};
+
+const uint32_t* crc_table()
+{
+    static uint32_t table[256];
+    static bool ready = [](){
+	for(uint32_t n = 0; n < 256; ++n)
+	{
+	    uint32_t c = n;
+	    for(int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+	    table[n] = c;
+	}
+	return true;
+    }();
+    (void)ready;
+    return table;
+}
+}
+
+// Decoder of a raw deflate stream (RFC 1951), one block at a time.
+class inflater
+{
+public:
+    inflater(const uint8_t* in, std::size_t len)
+	: in(in), in_len(len), in_pos(0), bit_buf(0), bit_cnt(0), padding(0)
+    {}
+
+    // Decode the next block and append its output to out. Back-references
+    // may refer to the (at most 32KB) data already in out. Return true if
+    // this is the last block of the stream.
+    bool inflate_block(std::string& out)
+    {
+	bool last = bits(1);
+	int type = bits(2);
+
+	if(type == 0) stored(out);
+	else if(type == 1)
+	{
+	    static const fixed_codes fixed;
+	    codes(out, fixed.lit, fixed.dist);
+	}
+	else if(type == 2) dynamic(out);
+	else corrupted("invalid block type");
+
+	if(padding * 8 > bit_cnt) corrupted("unexpected end of data");
+	return last;
+    }
+
+    // Number of input bytes used after the last block, the remaining bits
+    // of a partial byte are skipped.
+    std::size_t consumed() const
+    {
+	return in_pos + padding - bit_cnt / 8;
+    }
+
+private:
+    const uint8_t* in;
+    std::size_t in_len;
+    std::size_t in_pos;
+    uint64_t bit_buf;
+    int bit_cnt;
+    // Number of zero bytes fed after the end of input, they may be peeked
+    // at but must not be consumed.
+    int padding;
+
+    void need(int n)
+    {
+	while(bit_cnt < n)
+	{
+	    if(in_pos < in_len) bit_buf |= static_cast<uint64_t>(in[in_pos++]) << bit_cnt;
+	    else ++padding;
+	    bit_cnt += 8;
+	}
+    }
+
+    uint32_t bits(int n)
+    {
+	need(n);
+	uint32_t x = bit_buf & ((1ULL << n) - 1);
+	bit_buf >>= n;
+	bit_cnt -= n;
+	return x;
+    }
+
+    int decode(const huffman& h)
+    {
+	need(MAX_BITS);
+	uint16_t e = h.fast[bit_buf & ((1 << FAST_BITS) - 1)];
+	if(e != 0)
+	{
+	    bit_buf >>= e >> 9;
+	    bit_cnt -= e >> 9;
+	    return e & 511;
+	}
+
+	int code = 0;
+	int first = 0;
+	int index = 0;
+	for(int len = 1; len <= MAX_BITS; ++len)
+	{
+	    code |= bits(1);
+	    int count = h.count[len];
+	    if(code - count < first) return h.symbol[index + (code - first)];
+	    index += count;
+	    first += count;
+	    first <<= 1;
+	    code <<= 1;
+	}
+	corrupted("invalid Huffman code");
+	return -1;
+    }
+
+    void stored(std::string& out)
+    {
+	// go back to the byte boundary
+	in_pos = consumed();
+	bit_buf = 0;
+	bit_cnt = 0;
+	if(padding > 0 || in_pos + 4 > in_len) corrupted("unexpected end of data");
+
+	uint32_t len = read_le(in + in_pos, 2);
+	uint32_t nlen = read_le(in + in_pos + 2, 2);
+	if(len != (~nlen & 0xffff)) corrupted("invalid stored block length");
+	in_pos += 4;
+	if(in_pos + len > in_len) corrupted("unexpected end of data");
+
+	out.append(reinterpret_cast<const char*>(in + in_pos), len);
+	in_pos += len;
+    }
+
+    void dynamic(std::string& out)
+    {
+	static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5,
+					  11, 4, 12, 3, 13, 2, 14, 1, 15};
+	int nlen = bits(5) + 257;
+	int ndist = bits(5) + 1;
+	int ncode = bits(4) + 4;
+	if(nlen > 286 || ndist > 30) corrupted("too many length or distance codes");
+
+	uint8_t lengths[320];
+	std::memset(lengths, 0, 19);
+	for(int i = 0; i < ncode; ++i) lengths[order[i]] = bits(3);
+
+	huffman lencode;
+	lencode.build(lengths, 19);
+
+	int i = 0;
+	while(i < nlen + ndist)
+	{
+	    int sym = decode(lencode);
+	    if(sym < 16)
+	    {
+		lengths[i++] = sym;
+		continue;
+	    }
+
+	    int len = 0;
+	    int rep;
+	    if(sym == 16)
+	    {
+		if(i == 0) corrupted("repeat with no first length");
+		len = lengths[i - 1];
+		rep = 3 + bits(2);
+	    }
+	    else if(sym == 17) rep = 3 + bits(3);
+	    else rep = 11 + bits(7);
+
+	    if(i + rep > nlen + ndist) corrupted("too many code lengths");
+	    while(rep--) lengths[i++] = len;
+	}
+	if(lengths[256] == 0) corrupted("missing end-of-block code");
+
+	huffman lit, dist;
+	lit.build(lengths, nlen);
+	dist.build(lengths + nlen, ndist);
+	codes(out, lit, dist);
+    }
+
+    void codes(std::string& out, const huffman& lit, const huffman& dist)
+    {
+	// out is grown in chunks and trimmed at the end of the block
+	std::size_t n = out.size();
+	while(true)
+	{
+	    if(n + 258 > out.size()) out.resize(std::max<std::size_t>(2 * out.size(), n + (1 << 16)));
+	    char* p = &out[0];
+
+	    int sym = decode(lit);
+	    if(padding * 8 > bit_cnt) corrupted("unexpected end of data");
+	    if(sym < 256)
+	    {
+		p[n++] = static_cast<char>(sym);
+	    }
+	    else if(sym == 256)
+	    {
+		break;
+	    }
+	    else
+	    {
+		sym -= 257;
+		if(sym >= 29) corrupted("invalid length code");
+		int len = len_base[sym] + bits(len_extra[sym]);
+
+		sym = decode(dist);
+		if(sym >= 30) corrupted("invalid distance code");
+		std::size_t d = dist_base[sym] + bits(dist_extra[sym]);
+		if(d > n) corrupted("distance too far back");
+
+		const char* src = p + n - d;
+		for(int k = 0; k < len; ++k) p[n + k] = src[k];
+		n += len;
+	    }
+	}
+	out.resize(n);
+    }
+};
+
+gzip_stream::gzip_stream(const char* data, std::size_t size)
+    : data(reinterpret_cast<const uint8_t*>(data)), size(size), member_pos(0)
+{}
+
+gzip_stream::~gzip_stream()
+{}
+
+bool gzip_stream::is_gzip(const char* data, std::size_t size)
+{
+    return size >= 2 && static_cast<uint8_t>(data[0]) == 0x1f
+	&& static_cast<uint8_t>(data[1]) == 0x8b;
+}
+
+uint32_t gzip_stream::crc32(uint32_t crc, const char* data, std::size_t len)
+{
+    const uint32_t* table = crc_table();
+    crc = ~crc;
+    for(std::size_t i = 0; i < len; ++i)
+    {
+	crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+std::size_t gzip_stream::parse_header(std::size_t pos, std::size_t& block_size) const
+{
+    if(pos + 10 > size || data[pos] != 0x1f || data[pos + 1] != 0x8b || data[pos + 2] != 8)
+    {
+	corrupted("invalid member header");
+    }
+
+    int flags = data[pos + 3];
+    block_size = 0;
+    pos += 10;
+
+    // FEXTRA, a BGZF block has a subfield BC holding its size minus 1
+    if(flags & 4)
+    {
+	if(pos + 2 > size) corrupted("unexpected end of data");
+	std::size_t xlen = read_le(data + pos, 2);
+	std::size_t end = pos + 2 + xlen;
+	if(end > size) corrupted("unexpected end of data");
+
+	for(std::size_t p = pos + 2; p + 4 <= end; p += 4 + read_le(data + p + 2, 2))
+	{
+	    if(data[p] == 'B' && data[p + 1] == 'C' && read_le(data + p + 2, 2) == 2)
+	    {
+		block_size = read_le(data + p + 4, 2) + 1;
+	    }
+	}
+	pos = end;
+    }
+
+    // FNAME and FCOMMENT are zero-terminated
+    for(int f = 8; f <= 16; f <<= 1)
+    {
+	if(flags & f)
+	{
+	    while(pos < size && data[pos] != 0) ++pos;
+	    ++pos;
+	}
+    }
+
+    // FHCRC
+    if(flags & 2) pos += 2;
+
+    if(pos > size) corrupted("unexpected end of data");
+    return pos;
+}
+
+void gzip_stream::check_trailer(std::size_t pos, uint32_t crc, uint32_t isize) const
+{
+    if(pos + 8 > size) corrupted("unexpected end of data");
+    if(read_le(data + pos, 4) != crc) corrupted("CRC mismatch");
+    if(read_le(data + pos + 4, 4) != isize) corrupted("length mismatch");
+}
+
+bool gzip_stream::read(std::string& out)
+{
+    try
+    {
+	return read_member(out);
+    }
+    catch(const corrupt_input& e)
+    {
+	exit_corrupted(e.reason);
+    }
+    return false;
+}
+
+bool gzip_stream::read_member(std::string& out)
+{
+    if(!inf)
+    {
+	// trailing zeros after the last member are ignored as gzip does
+	while(member_pos < size && data[member_pos] == 0) ++member_pos;
+	if(member_pos >= size) return false;
+
+	std::size_t block_size;
+	std::size_t pos = parse_header(member_pos, block_size);
+	if(block_size > 0)
+	{
+	    read_bgzf(out);
+	    return true;
+	}
+
+	inf.reset(new inflater(data + pos, size - pos));
+	deflate_pos = pos;
+	window.clear();
+	crc = 0;
+	isize = 0;
+    }
+
+    // decompress about 1MB at a time, keep the last 32KB as history
+    const std::size_t history = 1 << 15;
+    std::size_t produced = 0;
+    bool last = false;
+    while(!last && produced < (1 << 20))
+    {
+	std::size_t st = window.size();
+	last = inf->inflate_block(window);
+
+	std::size_t len = window.size() - st;
+	crc = crc32(crc, window.data() + st, len);
+	isize += len;
+	out.append(window, st, len);
+	produced += len;
+
+	if(window.size() > 4 * history)
+	{
+	    window.erase(0, window.size() - history);
+	}
+    }
+
+    if(last)
+    {
+	std::size_t trailer = deflate_pos + inf->consumed();
+	check_trailer(trailer, crc, isize);
+	member_pos = trailer + 8;
+	inf.reset();
+    }
+
+    return true;
+}
+
+void gzip_stream::read_bgzf(std::string& out)
+{
+    // locate a run of consecutive BGZF blocks
+    const int num_threads = omp_in_parallel() ? 1 : std::min(omp_get_max_threads(), max_bgzf_threads);
+    const std::size_t max_blocks = 16 * num_threads;
+    std::vector<std::size_t> starts;
+    std::vector<std::size_t> deflates;
+    std::size_t pos = member_pos;
+    while(starts.size() < max_blocks && pos < size && data[pos] == 0x1f)
+    {
+	std::size_t block_size;
+	std::size_t deflate = parse_header(pos, block_size);
+	if(block_size == 0) break;
+	if(pos + block_size > size || deflate + 8 > pos + block_size)
+	{
+	    corrupted("invalid BGZF block size");
+	}
+
+	starts.push_back(pos);
+	deflates.push_back(deflate);
+	pos += block_size;
+    }
+    starts.push_back(pos);
+
+    int64_t n = deflates.size();
+    std::vector<std::string> blocks(n);
+    // the first error in block order is passed back to this thread
+    std::vector<const char*> errors(n, nullptr);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+    for(int64_t i = 0; i < n; ++i)
+    {
+	try
+	{
+	    // a BGZF block holds at most 64 KiB of uncompressed data
+	    std::size_t trailer = starts[i + 1] - 8;
+	    std::size_t isize = read_le(data + trailer + 4, 4);
+	    if(isize > 65536) corrupted("invalid BGZF block size");
+	    blocks[i].reserve(isize);
+
+	    inflater block(data + deflates[i], trailer - deflates[i]);
+	    while(!block.inflate_block(blocks[i]));
+	    if(deflates[i] + block.consumed() != trailer) corrupted("invalid BGZF block size");
+
+	    check_trailer(trailer, crc32(0, blocks[i].data(), blocks[i].size()), blocks[i].size());
+	}
+	catch(const corrupt_input& e)
+	{
+	    errors[i] = e.reason;
+	}
+    }
+
+    for(const char* reason : errors)
+    {
+	if(reason) corrupted(reason);
+    }
+
+    for(const std::string& b : blocks) out += b;
+    member_pos = pos;
+}
@@ -0,0 +1,70 @@
+/*
+  Part of SubseqSketch.
+  Decompression of gzip (including BGZF) files held in memory.
+  By Ke @ Penn State
+*/
+
+#ifndef __GZIP_STREAM_H__
+#define __GZIP_STREAM_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+class inflater;
+
+// Decompress a gzip file piece by piece. Members of a BGZF file are
+// independent and decompressed in parallel, other members are decompressed
+// one deflate block at a time so that only a small window is kept in
+// memory. Corrupted input is reported and the program exits, from the
+// thread calling read().
+class gzip_stream
+{
+public:
+    // The compressed file content must stay valid during decompression.
+    gzip_stream(const char* data, std::size_t size);
+    ~gzip_stream();
+
+    // Whether data starts with the gzip magic number.
+    static bool is_gzip(const char* data, std::size_t size);
+
+    // Decompress the next part of the file and append it to out. Return
+    // false if the end of the file has been reached.
+    bool read(std::string& out);
+
+    // Update a running CRC-32 (as used by gzip and zip) with len bytes.
+    static uint32_t crc32(uint32_t crc, const char* data, std::size_t len);
+
+private:
+    const uint8_t* data;
+    std::size_t size;
+    // Start of the next member to be decompressed.
+    std::size_t member_pos;
+
+    // State of a non-BGZF member being decompressed, inf is null if there
+    // is no such member. window holds the recent output which may be
+    // referred by the following blocks.
+    std::unique_ptr<inflater> inf;
+    std::size_t deflate_pos;
+    std::string window;
+    uint32_t crc;
+    uint32_t isize;
+
+    // Parse the member header at pos, return the offset of its deflate
+    // data. If it is a BGZF block, block_size is set to its total size,
+    // otherwise it is set to 0.
+    std::size_t parse_header(std::size_t pos, std::size_t& block_size) const;
+
+    // Verify the trailer of a member at pos against its decompressed data.
+    void check_trailer(std::size_t pos, uint32_t crc, uint32_t isize) const;
+
+    // read() without the error handling, corrupted input is raised as an
+    // exception to be reported by read().
+    bool read_member(std::string& out);
+
+    // Decompress a run of BGZF blocks starting at member_pos.
+    void read_bgzf(std::string& out);
+};
+
+#endif
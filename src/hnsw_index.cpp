@@ -0,0 +1,522 @@
+/*
+  Part of SubseqSketch.
+  Approximate nearest neighbor index (HNSW) of sketchings.
+  By Ke @ Penn State
+*/
+
+#include "hnsw_index.hpp"
+#include "sss_mapped.hpp"
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Eigen/Dense>
+
+namespace
+{
+const char index_magic[8] = {'S', 'S', 'S', 'I', 'N', 'D', 'E', 'X'};
+const uint32_t index_version = 1;
+
+// Normalized vectors closer than this are taken as duplicates.
+const float duplicate_dist = 1e-6f;
+
+struct index_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint64_t num;
+    uint32_t M;
+    uint32_t ef_construction;
+    uint32_t entry;
+    int32_t max_level;
+    // Number of uint32 in the upper layer links.
+    uint64_t upper_size;
+    char reserved[16];
+};
+
+static_assert(sizeof(index_header) == 64, "index_header must take 64 bytes");
+
+std::size_t align64(std::size_t x)
+{
+    return (x + 63) / 64 * 64;
+}
+
+// Offsets of the sections of an index file.
+struct index_layout
+{
+    std::size_t vectors;
+    std::size_t levels;
+    std::size_t offsets;
+    std::size_t links0;
+    std::size_t upper;
+    std::size_t end;
+
+    index_layout(std::size_t num, std::size_t dim, std::size_t M0, std::size_t upper_size)
+    {
+	vectors = sizeof(index_header) + sizeof(sss_header);
+	levels = align64(vectors + sizeof(float) * num * dim);
+	offsets = align64(levels + sizeof(int32_t) * num);
+	links0 = align64(offsets + sizeof(uint64_t) * (num + 1));
+	upper = align64(links0 + sizeof(uint32_t) * num * (1 + M0));
+	end = upper + sizeof(uint32_t) * upper_size;
+    }
+};
+
+// Write data at offset, padding the file with zeros up to it.
+void write_at(std::ofstream& fout, std::size_t offset, const void* data, std::size_t len)
+{
+    std::size_t pos = fout.tellp();
+    std::string padding(offset - pos, '\0');
+    fout << padding;
+    fout.write(static_cast<const char*>(data), len);
+}
+}
+
+void hnsw_index::visited_list::clear()
+{
+    if(++epoch == 0)
+    {
+	std::fill(marks.begin(), marks.end(), 0);
+	epoch = 1;
+    }
+}
+
+bool hnsw_index::visited_list::visit(uint32_t node)
+{
+    if(marks[node] == epoch) return true;
+    marks[node] = epoch;
+    return false;
+}
+
+hnsw_index::hnsw_index(const std::vector<std::string>& sketch_files,
+		       std::size_t M, std::size_t ef_construction, uint64_t seed)
+    : num(0), dims(0), M(std::max<std::size_t>(2, M)), M0(2 * this->M),
+      ef_construction(std::max(ef_construction, this->M)),
+      entry(0), max_level(-1), file_data(nullptr), file_size(0), mapped(false)
+{
+    // all the sketchings are normalized into vector_store in file order
+    std::vector<std::unique_ptr<sss_mapped> > inputs;
+    for(const std::string& file : sketch_files)
+    {
+	inputs.emplace_back(new sss_mapped(file));
+	sss_array::check_compatible(inputs[0]->header(), sketch_files[0],
+				    inputs.back()->header(), file);
+	num += inputs.back()->rows();
+    }
+    if(num >= 0xffffffffULL)
+    {
+	std::cerr << "Error: too many sketchings to index: " << num << std::endl;
+	std::exit(1);
+    }
+
+    sketches = inputs[0]->header();
+    sketches.num_sketches = num;
+    for(const std::unique_ptr<sss_mapped>& input : inputs)
+    {
+	sketches.max_val = std::max(sketches.max_val, input->header().max_val);
+	if(input->header().subseq_hash == 0) sketches.subseq_hash = 0;
+    }
+    dims = sketches.sketch_len;
+
+    vector_store.resize(num * dims);
+    std::size_t row = 0;
+    for(const std::unique_ptr<sss_mapped>& input : inputs)
+    {
+	const std::size_t step = 4096;
+	for(std::size_t i = 0; i < input->rows(); i += step)
+	{
+	    std::size_t n = std::min(step, input->rows() - i);
+	    normalized_rows(*input, i, n, vector_store.data() + (row + i) * dims);
+	}
+	row += input->rows();
+    }
+    inputs.clear();
+
+    // levels are drawn up front so that all the links can be allocated
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    double level_mult = 1 / std::log(double(this->M));
+    level_store.resize(num);
+    offset_store.assign(num + 1, 0);
+    for(std::size_t i = 0; i < num; ++i)
+    {
+	level_store[i] = static_cast<int32_t>(-std::log(1.0 - uniform(rng)) * level_mult);
+	offset_store[i + 1] = offset_store[i] + level_store[i] * (1 + this->M);
+    }
+    link0_store.assign(num * (1 + M0), 0);
+    upper_store.assign(offset_store[num], 0);
+
+    vectors = vector_store.data();
+    levels = level_store.data();
+    upper_offsets = offset_store.data();
+    links0 = link0_store.data();
+    upper_links = upper_store.data();
+
+    if(num == 0) return;
+
+    node_locks.reset(new std::mutex[num]);
+    entry = 0;
+    max_level = levels[0];
+
+#pragma omp parallel
+    {
+	visited_list visited(num);
+#pragma omp for schedule(dynamic, 16)
+	for(long long i = 1; i < static_cast<long long>(num); ++i)
+	{
+	    insert(i, visited);
+	}
+    }
+
+    node_locks.reset();
+}
+
+hnsw_index::hnsw_index(const std::string& index_file)
+    : file_data(nullptr), file_size(0), mapped(false)
+{
+    int fd = open(index_file.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+	// throw std::runtime_error("Could not open the file: " + index_file);
+	std::cerr << "Error: could not open the file: "
+		  << index_file << std::endl;
+	std::exit(1);
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+	void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(p != MAP_FAILED)
+	{
+	    // the graph is traversed in no particular order
+	    madvise(p, st.st_size, MADV_RANDOM);
+	    file_data = static_cast<const char*>(p);
+	    file_size = st.st_size;
+	    mapped = true;
+	}
+    }
+    close(fd);
+
+    if(!mapped)
+    {
+	// not a regular file or cannot be mapped, read all at once
+	std::ifstream fin(index_file, std::ios::binary);
+	buffer.assign(std::istreambuf_iterator<char>(fin),
+		      std::istreambuf_iterator<char>());
+	file_data = buffer.data();
+	file_size = buffer.size();
+    }
+
+    index_header header;
+    if(file_size < sizeof(header) + sizeof(sss_header))
+    {
+	std::cerr << "Error: " << index_file
+		  << " does not appear to be a valid index file" << std::endl;
+	std::exit(1);
+    }
+    std::copy(file_data, file_data + sizeof(header), reinterpret_cast<char*>(&header));
+    std::copy(file_data + sizeof(header), file_data + sizeof(header) + sizeof(sss_header),
+	      reinterpret_cast<char*>(&sketches));
+    if(!std::equal(index_magic, index_magic + sizeof(index_magic), header.magic) ||
+       header.version > index_version)
+    {
+	std::cerr << "Error: " << index_file
+		  << " does not appear to be a valid index file" << std::endl;
+	std::exit(1);
+    }
+
+    num = header.num;
+    dims = header.dim;
+    M = header.M;
+    M0 = 2 * M;
+    ef_construction = header.ef_construction;
+    entry = header.entry;
+    max_level = header.max_level;
+
+    index_layout layout(num, dims, M0, header.upper_size);
+    if(layout.end > file_size)
+    {
+	std::cerr << "Error: the index file is truncated: "
+		  << index_file << std::endl;
+	std::exit(1);
+    }
+    vectors = reinterpret_cast<const float*>(file_data + layout.vectors);
+    levels = reinterpret_cast<const int32_t*>(file_data + layout.levels);
+    upper_offsets = reinterpret_cast<const uint64_t*>(file_data + layout.offsets);
+    links0 = reinterpret_cast<const uint32_t*>(file_data + layout.links0);
+    upper_links = reinterpret_cast<const uint32_t*>(file_data + layout.upper);
+}
+
+hnsw_index::~hnsw_index()
+{
+    if(mapped)
+    {
+	munmap(const_cast<char*>(file_data), file_size);
+    }
+}
+
+void hnsw_index::save(const std::string& index_file) const
+{
+    std::ofstream fout(index_file, std::ios::binary);
+    if(!fout)
+    {
+	// throw std::runtime_error("Could not write to the file: " + index_file);
+	std::cerr << "Error: could not write to the file: "
+		  << index_file << std::endl;
+	std::exit(1);
+    }
+
+    index_header header;
+    std::fill(reinterpret_cast<char*>(&header), reinterpret_cast<char*>(&header + 1), 0);
+    std::copy(index_magic, index_magic + sizeof(index_magic), header.magic);
+    header.version = index_version;
+    header.dim = dims;
+    header.num = num;
+    header.M = M;
+    header.ef_construction = ef_construction;
+    header.entry = entry;
+    header.max_level = max_level;
+    header.upper_size = upper_offsets[num];
+
+    index_layout layout(num, dims, M0, header.upper_size);
+    write_at(fout, 0, &header, sizeof(header));
+    write_at(fout, sizeof(header), &sketches, sizeof(sketches));
+    write_at(fout, layout.vectors, vectors, sizeof(float) * num * dims);
+    write_at(fout, layout.levels, levels, sizeof(int32_t) * num);
+    write_at(fout, layout.offsets, upper_offsets, sizeof(uint64_t) * (num + 1));
+    write_at(fout, layout.links0, links0, sizeof(uint32_t) * num * (1 + M0));
+    write_at(fout, layout.upper, upper_links, sizeof(uint32_t) * header.upper_size);
+    fout.close();
+}
+
+void hnsw_index::normalized_rows(const sss_mapped& sketch,
+				 std::size_t first, std::size_t n, float* out)
+{
+    Eigen::MatrixXf rows = sketch.normalized_block<float>(first, n);
+    Eigen::Map<Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> >(out, n, sketch.cols()) = rows;
+}
+
+float hnsw_index::distance(const float* x, const float* y) const
+{
+    return 1 - Eigen::Map<const Eigen::VectorXf>(x, dims).dot(Eigen::Map<const Eigen::VectorXf>(y, dims));
+}
+
+const uint32_t* hnsw_index::links(uint32_t node, int level) const
+{
+    if(level == 0) return links0 + std::size_t(node) * (1 + M0);
+    return upper_links + upper_offsets[node] + (level - 1) * (1 + M);
+}
+
+uint32_t* hnsw_index::mutable_links(uint32_t node, int level)
+{
+    if(level == 0) return link0_store.data() + std::size_t(node) * (1 + M0);
+    return upper_store.data() + offset_store[node] + (level - 1) * (1 + M);
+}
+
+void hnsw_index::copy_links(uint32_t node, int level, std::vector<uint32_t>& out) const
+{
+    std::unique_lock<std::mutex> lock;
+    if(node_locks) lock = std::unique_lock<std::mutex>(node_locks[node]);
+
+    const uint32_t* list = links(node, level);
+    out.assign(list + 1, list + 1 + list[0]);
+}
+
+void hnsw_index::greedy_search(const float* x, uint32_t& ep, float& ep_dist, int level) const
+{
+    std::vector<uint32_t> neighbors;
+    bool changed = true;
+    while(changed)
+    {
+	changed = false;
+	copy_links(ep, level, neighbors);
+	for(uint32_t n : neighbors)
+	{
+	    float d = distance(x, vec(n));
+	    if(d < ep_dist)
+	    {
+		ep = n;
+		ep_dist = d;
+		changed = true;
+	    }
+	}
+    }
+}
+
+std::vector<hnsw_index::neighbor> hnsw_index::search_layer(const float* x, uint32_t ep, float ep_dist,
+							   std::size_t ef, int level,
+							   visited_list& visited) const
+{
+    // closest candidates first, farthest of the found ones first
+    std::priority_queue<neighbor, std::vector<neighbor>, std::greater<neighbor> > cands;
+    std::priority_queue<neighbor> found;
+
+    visited.clear();
+    visited.visit(ep);
+    cands.emplace(ep_dist, ep);
+    found.emplace(ep_dist, ep);
+
+    std::vector<uint32_t> neighbors;
+    while(!cands.empty())
+    {
+	neighbor c = cands.top();
+	if(c.first > found.top().first && found.size() >= ef) break;
+	cands.pop();
+
+	copy_links(c.second, level, neighbors);
+	for(uint32_t n : neighbors)
+	{
+	    if(visited.visit(n)) continue;
+
+	    float d = distance(x, vec(n));
+	    if(found.size() < ef || d < found.top().first)
+	    {
+		cands.emplace(d, n);
+		found.emplace(d, n);
+		if(found.size() > ef) found.pop();
+	    }
+	}
+    }
+
+    std::vector<neighbor> result(found.size());
+    for(std::size_t i = result.size(); i > 0; --i)
+    {
+	result[i - 1] = found.top();
+	found.pop();
+    }
+
+    return result;
+}
+
+std::vector<uint32_t> hnsw_index::select_neighbors(const std::vector<neighbor>& cands,
+						   std::size_t m) const
+{
+    std::vector<uint32_t> selected;
+    std::vector<uint32_t> pruned;
+    for(const neighbor& c : cands)
+    {
+	if(selected.size() >= m) break;
+
+	// duplicates of a picked one are not diverse even if the base node is
+	// one of them
+	bool diverse = true;
+	float bound = std::max(c.first, duplicate_dist);
+	for(uint32_t s : selected)
+	{
+	    if(distance(vec(c.second), vec(s)) < bound)
+	    {
+		diverse = false;
+		break;
+	    }
+	}
+	if(diverse) selected.push_back(c.second);
+	else pruned.push_back(c.second);
+    }
+
+    // fill up with the pruned ones, otherwise nodes among duplicates keep
+    // only each other and the graph falls apart
+    for(std::size_t i = 0; i < pruned.size() && selected.size() < m; ++i)
+    {
+	selected.push_back(pruned[i]);
+    }
+
+    return selected;
+}
+
+void hnsw_index::insert(uint32_t node, visited_list& visited)
+{
+    // a node above the current top level becomes the new entry point, the
+    // entry lock is held during its insertion
+    int level = levels[node];
+    std::unique_lock<std::mutex> lock(entry_lock);
+    int top = max_level;
+    uint32_t ep = entry;
+    if(level <= top) lock.unlock();
+
+    const float* x = vec(node);
+    float ep_dist = distance(x, vec(ep));
+    for(int lc = top; lc > level; --lc)
+    {
+	greedy_search(x, ep, ep_dist, lc);
+    }
+
+    for(int lc = std::min(level, top); lc >= 0; --lc)
+    {
+	std::vector<neighbor> found = search_layer(x, ep, ep_dist, ef_construction, lc, visited);
+	std::vector<uint32_t> selected = select_neighbors(found, M);
+	{
+	    std::lock_guard<std::mutex> guard(node_locks[node]);
+	    uint32_t* list = mutable_links(node, lc);
+	    list[0] = selected.size();
+	    std::copy(selected.begin(), selected.end(), list + 1);
+	}
+	for(uint32_t other : selected)
+	{
+	    connect(other, node, lc);
+	}
+	ep = found[0].second;
+	ep_dist = found[0].first;
+    }
+
+    if(level > top)
+    {
+	entry = node;
+	max_level = level;
+    }
+}
+
+void hnsw_index::connect(uint32_t node, uint32_t other, int level)
+{
+    std::lock_guard<std::mutex> guard(node_locks[node]);
+    uint32_t* list = mutable_links(node, level);
+    std::size_t max_links = level == 0 ? M0 : M;
+    if(list[0] < max_links)
+    {
+	list[1 + list[0]] = other;
+	++list[0];
+	return;
+    }
+
+    // full, keep the most diverse of the old neighbors and the new one
+    std::vector<neighbor> cands;
+    cands.emplace_back(distance(vec(node), vec(other)), other);
+    for(uint32_t i = 0; i < list[0]; ++i)
+    {
+	cands.emplace_back(distance(vec(node), vec(list[1 + i])), list[1 + i]);
+    }
+    std::sort(cands.begin(), cands.end());
+
+    std::vector<uint32_t> selected = select_neighbors(cands, max_links);
+    list[0] = selected.size();
+    std::copy(selected.begin(), selected.end(), list + 1);
+}
+
+std::vector<hnsw_index::neighbor> hnsw_index::search(const float* x, std::size_t k,
+						     std::size_t ef,
+						     visited_list& visited) const
+{
+    if(num == 0) return std::vector<neighbor>();
+
+    uint32_t ep = entry;
+    float ep_dist = distance(x, vec(ep));
+    for(int lc = max_level; lc > 0; --lc)
+    {
+	greedy_search(x, ep, ep_dist, lc);
+    }
+
+    std::vector<neighbor> found = search_layer(x, ep, ep_dist, std::max(ef, k), 0, visited);
+    if(found.size() > k) found.resize(k);
+
+    return found;
+}
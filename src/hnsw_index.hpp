@@ -0,0 +1,145 @@
+/*
+  Part of SubseqSketch.
+  Approximate nearest neighbor index (HNSW) of sketchings.
+  By Ke @ Penn State
+*/
+
+#ifndef __HNSW_INDEX_H__
+#define __HNSW_INDEX_H__
+
+#include "sss_array.hpp"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+class sss_mapped;
+
+// Hierarchical navigable small world graph over the normalized sketchings
+// with the cosine distance (Malkov & Yashunin, 2018). The index file
+// stores the normalized vectors and the graph in fixed layouts so that it
+// can be mapped and queried without being read.
+//
+// File layout, each section starts at a multiple of 64 bytes: 64-byte
+// index header, the sss_header of the indexed sketchings, vectors
+// (num x dim float), levels (num int32), offsets of the upper layer links
+// (num + 1 uint64), layer 0 links (num x (1 + 2M) uint32, a count followed
+// by the ids) and upper layer links (M + 1 uint32 per node per layer).
+class hnsw_index
+{
+public:
+    // Distance to and id of an indexed sketching.
+    typedef std::pair<float, uint32_t> neighbor;
+
+    // Marks of the nodes visited by one search, reused by the searches of
+    // one thread.
+    class visited_list
+    {
+    public:
+	explicit visited_list(std::size_t size) : marks(size, 0), epoch(0) {}
+
+	void clear();
+	// Mark node, return whether it is visited before.
+	bool visit(uint32_t node);
+
+    private:
+	std::vector<uint32_t> marks;
+	uint32_t epoch;
+    };
+
+    // Build the index of the sketchings in sketch_files in parallel, ids
+    // follow the order of the files as in merge. Each node keeps up to M
+    // neighbors (2M at layer 0) chosen from ef_construction candidates.
+    hnsw_index(const std::vector<std::string>& sketch_files,
+	       std::size_t M, std::size_t ef_construction, uint64_t seed);
+
+    // Map an index written by save.
+    explicit hnsw_index(const std::string& index_file);
+    ~hnsw_index();
+
+    hnsw_index(const hnsw_index&) = delete;
+    hnsw_index& operator=(const hnsw_index&) = delete;
+
+    void save(const std::string& index_file) const;
+
+    std::size_t size() const { return num; }
+    std::size_t dim() const { return dims; }
+
+    // Header of the indexed sketchings, num_sketches is the total.
+    const sss_header& sketch_header() const { return sketches; }
+
+    // The k approximate nearest neighbors of the normalized vector x,
+    // sorted by distance, ef >= k candidates are kept during the search.
+    std::vector<neighbor> search(const float* x, std::size_t k, std::size_t ef,
+				 visited_list& visited) const;
+
+    // Rows [first, first + n) of sketch divided by their norms as floats,
+    // row by row in out.
+    static void normalized_rows(const sss_mapped& sketch,
+				std::size_t first, std::size_t n, float* out);
+
+private:
+    std::size_t num;
+    std::size_t dims;
+    std::size_t M;
+    std::size_t M0;
+    std::size_t ef_construction;
+    sss_header sketches;
+
+    uint32_t entry;
+    int max_level;
+
+    // Sections of the index, either in the stores below while building or
+    // in the mapped file.
+    const float* vectors;
+    const int32_t* levels;
+    const uint64_t* upper_offsets;
+    const uint32_t* links0;
+    const uint32_t* upper_links;
+
+    std::vector<float> vector_store;
+    std::vector<int32_t> level_store;
+    std::vector<uint64_t> offset_store;
+    std::vector<uint32_t> link0_store;
+    std::vector<uint32_t> upper_store;
+
+    // The index file, either mapped or read into buffer.
+    const char* file_data;
+    std::size_t file_size;
+    bool mapped;
+    std::vector<char> buffer;
+
+    // Locks of the link lists of each node and of the entry point, only
+    // used while building.
+    std::unique_ptr<std::mutex[]> node_locks;
+    std::mutex entry_lock;
+
+    const float* vec(uint32_t node) const { return vectors + std::size_t(node) * dims; }
+    float distance(const float* x, const float* y) const;
+
+    // Link list of node at level: the count followed by the ids.
+    const uint32_t* links(uint32_t node, int level) const;
+    uint32_t* mutable_links(uint32_t node, int level);
+
+    // Copy the neighbors of node at level, locking the node while building.
+    void copy_links(uint32_t node, int level, std::vector<uint32_t>& out) const;
+
+    // Move ep to the closest node to x reachable greedily at level.
+    void greedy_search(const float* x, uint32_t& ep, float& ep_dist, int level) const;
+
+    // The ef nearest nodes to x found from ep at level, sorted by distance.
+    std::vector<neighbor> search_layer(const float* x, uint32_t ep, float ep_dist,
+				       std::size_t ef, int level,
+				       visited_list& visited) const;
+
+    // Pick at most m of the sorted candidates, preferring those not closer
+    // to an already picked one than to the base node.
+    std::vector<uint32_t> select_neighbors(const std::vector<neighbor>& cands,
+					   std::size_t m) const;
+
+    void insert(uint32_t node, visited_list& visited);
+    void connect(uint32_t node, uint32_t other, int level);
+};
+
+#endif
@@ -0,0 +1,181 @@
+/*
+  Part of SubseqSketch.
+  Exact dot products of small integer sketchings.
+  By Ke @ Penn State
+*/
+
+#include "int_gemm.hpp"
+#include "int_gemm_kernels.hpp"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+typedef void (*multiply_fn)(const int16_t*, std::size_t, const int16_t*, std::size_t,
+			    std::size_t, int32_t*);
+
+int32_t scalar_dot1(const int16_t* a, const int16_t* b, std::size_t len)
+{
+    int32_t s = 0;
+    for(std::size_t k = 0; k < len; ++k)
+    {
+	s += int32_t(a[k]) * b[k];
+    }
+    return s;
+}
+
+void scalar_dot4(const int16_t* a, std::size_t stride, const int16_t* b,
+		 std::size_t len, int32_t* out)
+{
+    for(int r = 0; r < 4; ++r)
+    {
+	out[r] = scalar_dot1(a + r * stride, b, len);
+    }
+}
+
+void multiply_scalar(const int16_t* a, std::size_t n1,
+		     const int16_t* b, std::size_t n2,
+		     std::size_t stride, int32_t* out)
+{
+    blocked_multiply(a, n1, b, n2, stride, out, scalar_dot4, scalar_dot1);
+}
+
+#if defined(__SSE2__)
+int32_t hsum(__m128i s)
+{
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+__m128i madd2(__m128i s, const int16_t* a, const int16_t* b)
+{
+    const __m128i* x = reinterpret_cast<const __m128i*>(a);
+    const __m128i* y = reinterpret_cast<const __m128i*>(b);
+    s = _mm_add_epi32(s, _mm_madd_epi16(_mm_loadu_si128(x), _mm_loadu_si128(y)));
+    return _mm_add_epi32(s, _mm_madd_epi16(_mm_loadu_si128(x + 1), _mm_loadu_si128(y + 1)));
+}
+
+void sse2_dot4(const int16_t* a, std::size_t stride, const int16_t* b,
+	       std::size_t len, int32_t* out)
+{
+    __m128i s0 = _mm_setzero_si128(), s1 = s0, s2 = s0, s3 = s0;
+    for(std::size_t k = 0; k < len; k += 16)
+    {
+	s0 = madd2(s0, a + k, b + k);
+	s1 = madd2(s1, a + stride + k, b + k);
+	s2 = madd2(s2, a + 2 * stride + k, b + k);
+	s3 = madd2(s3, a + 3 * stride + k, b + k);
+    }
+    out[0] = hsum(s0);
+    out[1] = hsum(s1);
+    out[2] = hsum(s2);
+    out[3] = hsum(s3);
+}
+
+int32_t sse2_dot1(const int16_t* a, const int16_t* b, std::size_t len)
+{
+    __m128i s = _mm_setzero_si128();
+    for(std::size_t k = 0; k < len; k += 16)
+    {
+	s = madd2(s, a + k, b + k);
+    }
+    return hsum(s);
+}
+
+void multiply_sse2(const int16_t* a, std::size_t n1,
+		   const int16_t* b, std::size_t n2,
+		   std::size_t stride, int32_t* out)
+{
+    blocked_multiply(a, n1, b, n2, stride, out, sse2_dot4, sse2_dot1);
+}
+#endif
+
+// The kernel compiled for k, or null if it is not compiled in.
+multiply_fn kernel_function(int_gemm::kernel k)
+{
+    switch(k)
+    {
+    case int_gemm::SCALAR: return multiply_scalar;
+#if defined(__SSE2__)
+    case int_gemm::SSE2: return multiply_sse2;
+#endif
+#if defined(INT_GEMM_AVX2)
+    case int_gemm::AVX2: return int_gemm_avx2;
+#endif
+#if defined(INT_GEMM_AVX512)
+    case int_gemm::AVX512: return int_gemm_avx512;
+#endif
+#if defined(INT_GEMM_NEON)
+    case int_gemm::NEON: return int_gemm_neon;
+#endif
+    default: return nullptr;
+    }
+}
+
+bool cpu_supports(int_gemm::kernel k)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if(k == int_gemm::AVX2) return __builtin_cpu_supports("avx2");
+    if(k == int_gemm::AVX512) return __builtin_cpu_supports("avx512bw");
+#endif
+    // the baseline of the target
+    return kernel_function(k) != nullptr;
+}
+
+int_gemm::kernel widest_kernel()
+{
+    const int_gemm::kernel order[] = {int_gemm::AVX512, int_gemm::AVX2,
+				      int_gemm::NEON, int_gemm::SSE2};
+    for(int_gemm::kernel k : order)
+    {
+	if(kernel_function(k) && cpu_supports(k)) return k;
+    }
+    return int_gemm::SCALAR;
+}
+
+// The selected kernel, the widest one until select is called.
+int_gemm::kernel& current_kernel()
+{
+    static int_gemm::kernel k = widest_kernel();
+    return k;
+}
+}
+
+bool int_gemm::select(kernel k)
+{
+    if(k == AUTO) k = widest_kernel();
+    if(!kernel_function(k) || !cpu_supports(k)) return false;
+
+    current_kernel() = k;
+    return true;
+}
+
+int_gemm::kernel int_gemm::selected()
+{
+    return current_kernel();
+}
+
+const char* int_gemm::name(kernel k)
+{
+    switch(k)
+    {
+    case AUTO: return "auto";
+    case SCALAR: return "scalar";
+    case SSE2: return "sse2";
+    case AVX2: return "avx2";
+    case AVX512: return "avx512";
+    case NEON: return "neon";
+    }
+    return "unknown";
+}
+
+void int_gemm::multiply(const int16_t* a, std::size_t n1,
+			const int16_t* b, std::size_t n2,
+			std::size_t stride, int32_t* out)
+{
+    kernel_function(current_kernel())(a, n1, b, n2, stride, out);
+}
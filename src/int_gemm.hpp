@@ -0,0 +1,48 @@
+/*
+  Part of SubseqSketch.
+  Exact dot products of small integer sketchings.
+  By Ke @ Penn State
+*/
+
+#ifndef __INT_GEMM_H__
+#define __INT_GEMM_H__
+
+#include <cstddef>
+#include <cstdint>
+
+// Products of 16-bit integer rows accumulated in 32-bit integers, as done
+// by the pmaddwd instruction. The rows are zero padded to a multiple of
+// padding elements so that no remainder loop is needed.
+//
+// The kernels for the wider instruction sets are compiled in their own
+// translation units with their own flags, the widest one the CPU supports
+// is picked at run time so that one binary runs on every host.
+class int_gemm
+{
+public:
+    static const std::size_t padding = 16;
+
+    // Instruction sets of the kernels, AUTO is the widest one available.
+    enum kernel { AUTO, SCALAR, SSE2, AVX2, AVX512, NEON };
+
+    // Row stride for rows of len values.
+    static std::size_t stride(std::size_t len)
+    {
+	return (len + padding - 1) / padding * padding;
+    }
+
+    // Use kernel k for all later products. Return false if k is not
+    // compiled in or not supported by the CPU.
+    static bool select(kernel k);
+    static kernel selected();
+    static const char* name(kernel k);
+
+    // out(r, c) = dot(a[r], b[c]) stored column-major in out for n1 rows of
+    // a and n2 rows of b, all rows are stride values apart. The caller
+    // makes sure the dot products fit in int32.
+    static void multiply(const int16_t* a, std::size_t n1,
+			 const int16_t* b, std::size_t n2,
+			 std::size_t stride, int32_t* out);
+};
+
+#endif
@@ -0,0 +1,56 @@
+/*
+  Part of SubseqSketch.
+  Integer dot product kernel for AVX2, compiled with -mavx2.
+  By Ke @ Penn State
+*/
+
+#include "int_gemm_kernels.hpp"
+#include <immintrin.h>
+
+namespace
+{
+int32_t hsum(__m256i x)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+// Dot products of 4 rows of a with one row of b.
+void dot4(const int16_t* a, std::size_t stride, const int16_t* b,
+	  std::size_t len, int32_t* out)
+{
+    __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+    for(std::size_t k = 0; k < len; k += 16)
+    {
+	__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k));
+	s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + k)), y));
+	s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + stride + k)), y));
+	s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + 2 * stride + k)), y));
+	s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + 3 * stride + k)), y));
+    }
+    out[0] = hsum(s0);
+    out[1] = hsum(s1);
+    out[2] = hsum(s2);
+    out[3] = hsum(s3);
+}
+
+int32_t dot1(const int16_t* a, const int16_t* b, std::size_t len)
+{
+    __m256i s = _mm256_setzero_si256();
+    for(std::size_t k = 0; k < len; k += 16)
+    {
+	s = _mm256_add_epi32(s, _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + k)),
+						  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k))));
+    }
+    return hsum(s);
+}
+}
+
+void int_gemm_avx2(const int16_t* a, std::size_t n1,
+		   const int16_t* b, std::size_t n2,
+		   std::size_t stride, int32_t* out)
+{
+    blocked_multiply(a, n1, b, n2, stride, out, dot4, dot1);
+}
@@ -0,0 +1,57 @@
+/*
+  Part of SubseqSketch.
+  Integer dot product kernel for AVX-512, compiled with -mavx512bw.
+  By Ke @ Penn State
+*/
+
+#include "int_gemm_kernels.hpp"
+#include <immintrin.h>
+
+namespace
+{
+// Rows are padded to 16 values only, a row of an odd number of 16-value
+// chunks ends with a half load.
+const __mmask32 half = 0xffff;
+
+inline __m512i load(const int16_t* x, std::size_t k, std::size_t len)
+{
+    if(k + 32 <= len) return _mm512_loadu_si512(x + k);
+    return _mm512_maskz_loadu_epi16(half, x + k);
+}
+
+// Dot products of 4 rows of a with one row of b.
+void dot4(const int16_t* a, std::size_t stride, const int16_t* b,
+	  std::size_t len, int32_t* out)
+{
+    __m512i s0 = _mm512_setzero_si512(), s1 = s0, s2 = s0, s3 = s0;
+    for(std::size_t k = 0; k < len; k += 32)
+    {
+	__m512i y = load(b, k, len);
+	s0 = _mm512_add_epi32(s0, _mm512_madd_epi16(load(a, k, len), y));
+	s1 = _mm512_add_epi32(s1, _mm512_madd_epi16(load(a + stride, k, len), y));
+	s2 = _mm512_add_epi32(s2, _mm512_madd_epi16(load(a + 2 * stride, k, len), y));
+	s3 = _mm512_add_epi32(s3, _mm512_madd_epi16(load(a + 3 * stride, k, len), y));
+    }
+    out[0] = _mm512_reduce_add_epi32(s0);
+    out[1] = _mm512_reduce_add_epi32(s1);
+    out[2] = _mm512_reduce_add_epi32(s2);
+    out[3] = _mm512_reduce_add_epi32(s3);
+}
+
+int32_t dot1(const int16_t* a, const int16_t* b, std::size_t len)
+{
+    __m512i s = _mm512_setzero_si512();
+    for(std::size_t k = 0; k < len; k += 32)
+    {
+	s = _mm512_add_epi32(s, _mm512_madd_epi16(load(a, k, len), load(b, k, len)));
+    }
+    return _mm512_reduce_add_epi32(s);
+}
+}
+
+void int_gemm_avx512(const int16_t* a, std::size_t n1,
+		     const int16_t* b, std::size_t n2,
+		     std::size_t stride, int32_t* out)
+{
+    blocked_multiply(a, n1, b, n2, stride, out, dot4, dot1);
+}
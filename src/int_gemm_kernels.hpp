@@ -0,0 +1,62 @@
+/*
+  Part of SubseqSketch.
+  Blocking shared by the integer dot product kernels.
+  By Ke @ Penn State
+*/
+
+#ifndef __INT_GEMM_KERNELS_H__
+#define __INT_GEMM_KERNELS_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+// Entry points of the kernels compiled with their own instruction set
+// flags, see int_gemm::multiply for the arguments.
+void int_gemm_avx2(const int16_t* a, std::size_t n1,
+		   const int16_t* b, std::size_t n2,
+		   std::size_t stride, int32_t* out);
+void int_gemm_avx512(const int16_t* a, std::size_t n1,
+		     const int16_t* b, std::size_t n2,
+		     std::size_t stride, int32_t* out);
+void int_gemm_neon(const int16_t* a, std::size_t n1,
+		   const int16_t* b, std::size_t n2,
+		   std::size_t stride, int32_t* out);
+
+// Internal linkage, so that each translation unit keeps the copy compiled
+// with its own flags.
+namespace
+{
+// Rows of a kept in cache while all rows of b pass by.
+const std::size_t block_rows = 64;
+
+// Blocked product with the dot products of 4 rows of a with one row of b
+// (dot4) and of single rows (dot1).
+template<typename Dot4, typename Dot1>
+inline void blocked_multiply(const int16_t* a, std::size_t n1,
+			     const int16_t* b, std::size_t n2,
+			     std::size_t stride, int32_t* out,
+			     Dot4 dot4, Dot1 dot1)
+{
+    for(std::size_t r0 = 0; r0 < n1; r0 += block_rows)
+    {
+	std::size_t r1 = std::min(n1, r0 + block_rows);
+	for(std::size_t c = 0; c < n2; ++c)
+	{
+	    const int16_t* y = b + c * stride;
+	    int32_t* col = out + c * n1;
+	    std::size_t r = r0;
+	    for(; r + 4 <= r1; r += 4)
+	    {
+		dot4(a + r * stride, stride, y, stride, col + r);
+	    }
+	    for(; r < r1; ++r)
+	    {
+		col[r] = dot1(a + r * stride, y, stride);
+	    }
+	}
+    }
+}
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+  Part of SubseqSketch.
+  Integer dot product kernel for NEON (AArch64).
+  By Ke @ Penn State
+*/
+
+#include "int_gemm_kernels.hpp"
+#include <arm_neon.h>
+
+namespace
+{
+// Multiply-accumulate 8 values of x and y into s.
+inline int32x4_t madd8(int32x4_t s, const int16_t* x, const int16_t* y)
+{
+    int16x8_t u = vld1q_s16(x), v = vld1q_s16(y);
+    s = vmlal_s16(s, vget_low_s16(u), vget_low_s16(v));
+    return vmlal_high_s16(s, u, v);
+}
+
+// Dot products of 4 rows of a with one row of b.
+void dot4(const int16_t* a, std::size_t stride, const int16_t* b,
+	  std::size_t len, int32_t* out)
+{
+    int32x4_t s0 = vdupq_n_s32(0), s1 = s0, s2 = s0, s3 = s0;
+    for(std::size_t k = 0; k < len; k += 8)
+    {
+	s0 = madd8(s0, a + k, b + k);
+	s1 = madd8(s1, a + stride + k, b + k);
+	s2 = madd8(s2, a + 2 * stride + k, b + k);
+	s3 = madd8(s3, a + 3 * stride + k, b + k);
+    }
+    out[0] = vaddvq_s32(s0);
+    out[1] = vaddvq_s32(s1);
+    out[2] = vaddvq_s32(s2);
+    out[3] = vaddvq_s32(s3);
+}
+
+int32_t dot1(const int16_t* a, const int16_t* b, std::size_t len)
+{
+    int32x4_t s = vdupq_n_s32(0);
+    for(std::size_t k = 0; k < len; k += 8)
+    {
+	s = madd8(s, a + k, b + k);
+    }
+    return vaddvq_s32(s);
+}
+}
+
+void int_gemm_neon(const int16_t* a, std::size_t n1,
+		   const int16_t* b, std::size_t n2,
+		   std::size_t stride, int32_t* out)
+{
+    blocked_multiply(a, n1, b, n2, stride, out, dot4, dot1);
+}
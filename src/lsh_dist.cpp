@@ -0,0 +1,310 @@
+/*
+  Part of SubseqSketch.
+  Candidate pairs of close sketchings by locality-sensitive hashing.
+  By Ke @ Penn State
+*/
+
+#include "lsh_dist.hpp"
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <cstdlib>
+#include <omp.h>
+
+namespace
+{
+// Rows of a sketching file hashed or verified at a time.
+const std::size_t block_rows = 4096;
+
+// Distances below this are rounded to 0, as by tiled_dist in double.
+const double zero_threshold = 1e-8;
+
+typedef std::pair<uint64_t, uint32_t> keyed_row;
+
+// The keys of one band of all rows, sorted so that equal keys are adjacent.
+std::vector<keyed_row> band_keys(const std::vector<uint64_t>& sig,
+				 std::size_t band, std::size_t num)
+{
+    std::vector<keyed_row> keys(num);
+    for(std::size_t r = 0; r < num; ++r)
+    {
+	keys[r] = keyed_row(sig[band * num + r], r);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    return keys;
+}
+
+// End of the run of rows with the same key as keys[first].
+std::size_t key_run(const std::vector<keyed_row>& keys, std::size_t first)
+{
+    std::size_t last = first + 1;
+    while(last < keys.size() && keys[last].first == keys[first].first) ++last;
+    return last;
+}
+}
+
+lsh_dist::lsh_dist(const sss_mapped& sketch1, const sss_mapped& sketch2,
+		   std::size_t bands, std::size_t band_rows, std::size_t max_bucket,
+		   uint64_t seed)
+    : sketch1(sketch1), sketch2(sketch2), bands(bands), band_rows(band_rows),
+      max_bucket(max_bucket), symmetric(false)
+{
+    init(seed);
+}
+
+lsh_dist::lsh_dist(const sss_mapped& sketch, std::size_t bands, std::size_t band_rows,
+		   std::size_t max_bucket, uint64_t seed)
+    : sketch1(sketch), sketch2(sketch), bands(bands), band_rows(band_rows),
+      max_bucket(max_bucket), symmetric(true)
+{
+    init(seed);
+}
+
+void lsh_dist::init(uint64_t seed)
+{
+    if(bands == 0 || band_rows == 0 || band_rows > 64)
+    {
+	// throw std::invalid_argument("Invalid LSH bands or rows");
+	std::cerr << "Error: LSH needs at least one band of 1 to 64 rows, got "
+		  << bands << " bands of " << band_rows << " rows" << std::endl;
+	std::exit(1);
+    }
+    if(std::max(rows(), cols()) > 0xffffffffULL)
+    {
+	std::cerr << "Error: too many sketchings for LSH: "
+		  << std::max(rows(), cols()) << std::endl;
+	std::exit(1);
+    }
+
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<float> normal;
+    planes.resize(sketch1.cols(), bands * band_rows);
+    for(Eigen::Index c = 0; c < planes.cols(); ++c)
+    {
+	for(Eigen::Index r = 0; r < planes.rows(); ++r)
+	{
+	    planes(r, c) = normal(rng);
+	}
+    }
+
+    Eigen::VectorXd mean = normalized_sum(sketch1);
+    std::size_t num = rows();
+    if(!symmetric)
+    {
+	mean += normalized_sum(sketch2);
+	num += cols();
+    }
+    mean /= std::max<std::size_t>(num, 1);
+    center = mean.transpose().cast<float>() * planes;
+}
+
+Eigen::VectorXd lsh_dist::normalized_sum(const sss_mapped& sketch) const
+{
+    std::size_t num = sketch.rows();
+    long long num_blocks = (num + block_rows - 1) / block_rows;
+    std::vector<Eigen::VectorXd> sums(num_blocks);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for(long long k = 0; k < num_blocks; ++k)
+    {
+	std::size_t first = k * block_rows;
+	sums[k] = sketch.normalized_block<double>(first, std::min(block_rows, num - first)).colwise().sum().transpose();
+    }
+
+    Eigen::VectorXd sum = Eigen::VectorXd::Zero(sketch.cols());
+    for(const Eigen::VectorXd& x : sums)
+    {
+	sum += x;
+    }
+    return sum;
+}
+
+std::vector<uint64_t> lsh_dist::signatures(const sss_mapped& sketch) const
+{
+    std::size_t num = sketch.rows();
+    std::vector<uint64_t> sig(num * bands);
+    long long num_blocks = (num + block_rows - 1) / block_rows;
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for(long long k = 0; k < num_blocks; ++k)
+    {
+	std::size_t first = k * block_rows;
+	std::size_t n = std::min(block_rows, num - first);
+	// (x / |x| - mean) * planes
+	Eigen::MatrixXf proj = sketch.normalized_block<double>(first, n).cast<float>() * planes;
+	proj.rowwise() -= center;
+	for(std::size_t r = 0; r < n; ++r)
+	{
+	    for(std::size_t b = 0; b < bands; ++b)
+	    {
+		uint64_t key = 0;
+		for(std::size_t t = 0; t < band_rows; ++t)
+		{
+		    key = (key << 1) | (proj(r, b * band_rows + t) > 0);
+		}
+		sig[b * num + first + r] = key;
+	    }
+	}
+    }
+
+    return sig;
+}
+
+std::vector<uint64_t> lsh_dist::candidates() const
+{
+    std::vector<uint64_t> sig1 = signatures(sketch1);
+    std::vector<uint64_t> sig2;
+    if(!symmetric) sig2 = signatures(sketch2);
+
+    std::vector<uint64_t> pairs;
+    std::size_t capped = 0;
+#pragma omp parallel reduction(+:capped)
+    {
+	std::vector<uint64_t> found;
+#pragma omp for schedule(dynamic, 1)
+	for(long long b = 0; b < static_cast<long long>(bands); ++b)
+	{
+	    std::size_t old_size = found.size();
+	    std::vector<keyed_row> keys1 = band_keys(sig1, b, rows());
+	    if(symmetric)
+	    {
+		// rows are sorted by index within a run of equal keys
+		for(std::size_t p = 0; p < keys1.size(); )
+		{
+		    std::size_t end = key_run(keys1, p);
+		    if(max_bucket > 0 && end - p > max_bucket) ++capped;
+		    for(std::size_t x = p; x < end; ++x)
+		    {
+			std::size_t last = max_bucket > 0 ? std::min(end, x + 1 + max_bucket) : end;
+			for(std::size_t y = x + 1; y < last; ++y)
+			{
+			    found.push_back(uint64_t(keys1[x].second) << 32 | keys1[y].second);
+			}
+		    }
+		    p = end;
+		}
+	    }
+	    else
+	    {
+		std::vector<keyed_row> keys2 = band_keys(sig2, b, cols());
+		std::size_t p = 0, q = 0;
+		while(p < keys1.size() && q < keys2.size())
+		{
+		    if(keys1[p].first < keys2[q].first) ++p;
+		    else if(keys2[q].first < keys1[p].first) ++q;
+		    else
+		    {
+			std::size_t end1 = key_run(keys1, p);
+			std::size_t end2 = key_run(keys2, q);
+			// with more rows than max_bucket on the second side, the
+			// rows of the first side take consecutive windows of them
+			std::size_t window = end2 - q;
+			if(max_bucket > 0 && window > max_bucket)
+			{
+			    window = max_bucket;
+			    ++capped;
+			}
+			for(std::size_t x = p; x < end1; ++x)
+			{
+			    std::size_t from = q + (x - p) * window % (end2 - q + 1 - window);
+			    for(std::size_t y = from; y < from + window; ++y)
+			    {
+				found.push_back(uint64_t(keys1[x].second) << 32 | keys2[y].second);
+			    }
+			}
+			p = end1;
+			q = end2;
+		    }
+		}
+	    }
+
+	    // the pairs of one band are distinct, but a pair is usually found
+	    // by several bands
+	    std::sort(found.begin() + old_size, found.end());
+	    std::inplace_merge(found.begin(), found.begin() + old_size, found.end());
+	    found.erase(std::unique(found.begin(), found.end()), found.end());
+	}
+
+#pragma omp critical
+	pairs.insert(pairs.end(), found.begin(), found.end());
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    if(capped > 0)
+    {
+	std::cerr << "Warning: " << capped << " LSH bucket(s) held more than " << max_bucket
+		  << " sketchings (many near-identical ones, or too few rows per band),"
+		  << " each sketching was only paired with the next " << max_bucket
+		  << " in them" << std::endl;
+    }
+
+    return pairs;
+}
+
+sparse_dist lsh_dist::verify(const std::vector<uint64_t>& pairs, double max_dist) const
+{
+    // the pairs of each block of rows are verified together, the rows of
+    // the second file are gathered once per block
+    long long num_blocks = (rows() + block_rows - 1) / block_rows;
+    std::vector<std::size_t> block_start(num_blocks + 1);
+    for(long long k = 0; k <= num_blocks; ++k)
+    {
+	uint64_t first = uint64_t(std::min<std::size_t>(k * block_rows, rows())) << 32;
+	block_start[k] = std::lower_bound(pairs.begin(), pairs.end(), first) - pairs.begin();
+    }
+
+    std::vector<std::vector<std::pair<uint64_t, double> > > kept(num_blocks);
+#pragma omp parallel for schedule(dynamic, 1)
+    for(long long k = 0; k < num_blocks; ++k)
+    {
+	if(block_start[k] == block_start[k + 1]) continue;
+
+	std::size_t first = k * block_rows;
+	// one sketching per column, so that the dot products read contiguous values
+	Eigen::MatrixXd rows1 = sketch1.normalized_block<double>(first, std::min(block_rows, rows() - first)).transpose();
+
+	std::vector<uint32_t> ids;
+	for(std::size_t p = block_start[k]; p < block_start[k + 1]; ++p)
+	{
+	    ids.push_back(pairs[p] & 0xffffffff);
+	}
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+	Eigen::MatrixXd rows2(sketch2.cols(), ids.size());
+	for(std::size_t c = 0; c < ids.size(); ++c)
+	{
+	    rows2.col(c) = sketch2.normalized_block<double>(ids[c], 1).transpose();
+	}
+
+	for(std::size_t p = block_start[k]; p < block_start[k + 1]; ++p)
+	{
+	    std::size_t i = (pairs[p] >> 32) - first;
+	    std::size_t c = std::lower_bound(ids.begin(), ids.end(), uint32_t(pairs[p] & 0xffffffff)) - ids.begin();
+	    double d = 1 - rows1.col(i).dot(rows2.col(c));
+	    if(d < zero_threshold) d = 0;
+	    if(d <= max_dist) kept[k].emplace_back(pairs[p], d);
+	}
+    }
+
+    sparse_dist sparse(rows(), cols(), max_dist, symmetric ? sparse_dist::UPPER_TRIANGLE : 0);
+    for(const std::vector<std::pair<uint64_t, double> >& block : kept)
+    {
+	for(const std::pair<uint64_t, double>& x : block)
+	{
+	    sparse.indptr[(x.first >> 32) + 1]++;
+	    sparse.indices.push_back(x.first & 0xffffffff);
+	    sparse.data.push_back(x.second);
+	}
+    }
+    for(std::size_t i = 0; i < rows(); ++i)
+    {
+	sparse.indptr[i + 1] += sparse.indptr[i];
+    }
+
+    return sparse;
+}
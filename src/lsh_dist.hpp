@@ -0,0 +1,79 @@
+/*
+  Part of SubseqSketch.
+  Candidate pairs of close sketchings by locality-sensitive hashing.
+  By Ke @ Penn State
+*/
+
+#ifndef __LSH_DIST_H__
+#define __LSH_DIST_H__
+
+#include "sss_mapped.hpp"
+#include "sparse_dist.hpp"
+#include <vector>
+#include <cstdint>
+#include <Eigen/Dense>
+
+// Random hyperplane (SimHash) signatures of the rows of two mapped
+// sketching files: bit t of a row is the sign of its dot product with the
+// t-th random hyperplane, so two rows at angle a agree on it with
+// probability 1 - a / pi. Sketchings have no negative entries and even
+// unrelated ones are within a narrow cone, so the normalized rows are first
+// centered by their mean, which spreads them around the origin. The bits
+// are split into bands of band_rows bits, and two rows become a candidate
+// pair if they agree on all the bits of at least one band. Only the
+// candidates are compared by the exact cosine distance, so the cost grows
+// with the number of candidates instead of the number of all pairs. All the
+// pairs in a bucket of rows sharing a band key are candidates, unless
+// max_bucket is set to pair each row only with the next max_bucket rows in
+// it, so that a few huge buckets (e.g., of many near-identical sketchings)
+// cannot make the candidates quadratic.
+class lsh_dist
+{
+public:
+    // A max_bucket of 0 pairs all the rows of a bucket.
+    lsh_dist(const sss_mapped& sketch1, const sss_mapped& sketch2,
+	     std::size_t bands, std::size_t band_rows, std::size_t max_bucket = 0,
+	     uint64_t seed = 1);
+
+    // Candidates within one file, only the pairs i < j.
+    lsh_dist(const sss_mapped& sketch, std::size_t bands, std::size_t band_rows,
+	     std::size_t max_bucket = 0, uint64_t seed = 1);
+
+    std::size_t rows() const { return sketch1.rows(); }
+    std::size_t cols() const { return sketch2.rows(); }
+
+    // The candidate pairs as (row << 32 | col), sorted and distinct. A
+    // warning is printed if some buckets are larger than a nonzero
+    // max_bucket.
+    std::vector<uint64_t> candidates() const;
+
+    // The exact distances of the candidate pairs not larger than max_dist,
+    // rounded to 0 below the same threshold as tiled_dist.
+    sparse_dist verify(const std::vector<uint64_t>& pairs, double max_dist) const;
+
+private:
+    const sss_mapped& sketch1;
+    const sss_mapped& sketch2;
+    std::size_t bands;
+    std::size_t band_rows;
+    std::size_t max_bucket;
+    bool symmetric;
+
+    // sketch_len x (bands * band_rows) Gaussian hyperplanes.
+    Eigen::MatrixXf planes;
+    // The mean of the normalized rows of both files projected on the
+    // planes, subtracted from the projection of each row.
+    Eigen::RowVectorXf center;
+
+    void init(uint64_t seed);
+
+    // Sum of the normalized rows of sketch, blocks are summed in order so
+    // that the signatures do not depend on the number of threads.
+    Eigen::VectorXd normalized_sum(const sss_mapped& sketch) const;
+
+    // The band keys of all rows of sketch, the key of row r in band b is
+    // at b * rows + r.
+    std::vector<uint64_t> signatures(const sss_mapped& sketch) const;
+};
+
+#endif
@@ -0,0 +1,308 @@
+/*
+  Part of SubseqSketch.
+  Neighbor-joining tree of the sketchings.
+  By Ke @ Penn State
+*/
+
+#include "nj_tree.hpp"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <cctype>
+#include <limits>
+#include <cstdlib>
+#include <omp.h>
+
+namespace
+{
+// The pair of slots minimizing Q, ties broken by the slots so that the
+// tree does not depend on the number of threads.
+struct best_pair
+{
+    double q;
+    std::size_t a;
+    std::size_t b;
+
+    bool operator<(const best_pair& x) const
+    {
+	return q < x.q || (q == x.q && (a < x.a || (a == x.a && b < x.b)));
+    }
+};
+
+// Newick names cannot contain blanks or the punctuation of the format.
+std::string newick_name(const std::string& label)
+{
+    std::string name = label;
+    for(char& c : name)
+    {
+	if(std::isspace(static_cast<unsigned char>(c)) || c == '(' || c == ')' ||
+	   c == '[' || c == ']' || c == ',' || c == ':' || c == ';' || c == '\'')
+	{
+	    c = '_';
+	}
+    }
+    return name;
+}
+}
+
+nj_tree::nj_tree(const tiled_dist& dist)
+    : num(dist.rows()), dists(num * (num - std::min<std::size_t>(num, 1)) / 2)
+{
+    // tiles on and above the diagonal only write their own entries
+    dist.for_each_tile([&](std::size_t i, std::size_t j, const Eigen::MatrixXd& tile)
+    {
+	for(Eigen::Index c = 0; c < tile.cols(); ++c)
+	{
+	    std::size_t b = j + c;
+	    for(Eigen::Index r = 0; r < tile.rows() && i + r < b; ++r)
+	    {
+		dists[b * (b - 1) / 2 + i + r] = tile(r, c);
+	    }
+	}
+    });
+}
+
+nj_tree::nj_tree(const std::string& dist_file)
+{
+    std::ifstream fin(dist_file, std::ios::binary);
+    if(!fin)
+    {
+	// throw std::runtime_error("Could not open the file: " + dist_file);
+	std::cerr << "Error: could not open the file: "
+		  << dist_file << std::endl;
+	std::exit(1);
+    }
+
+    int rows = 0, cols = 0;
+    fin.read(reinterpret_cast<char*>(&rows), sizeof(rows));
+    fin.read(reinterpret_cast<char*>(&cols), sizeof(cols));
+    if(!fin || rows != cols || rows < 0)
+    {
+	std::cerr << "Error: a square distance matrix is required, got "
+		  << rows << "x" << cols << " in the file: " << dist_file << std::endl;
+	std::exit(1);
+    }
+
+    // column b holds d(a, b) for all a, the upper triangle of the
+    // column-major matrix is read column by column
+    num = rows;
+    dists.resize(num * (num - std::min<std::size_t>(num, 1)) / 2);
+    std::vector<double> col(num);
+    for(std::size_t b = 0; b < num; ++b)
+    {
+	fin.read(reinterpret_cast<char*>(col.data()), sizeof(double) * num);
+	if(!fin)
+	{
+	    std::cerr << "Error: the distance matrix is truncated: "
+		      << dist_file << std::endl;
+	    std::exit(1);
+	}
+	std::copy(col.begin(), col.begin() + b, dists.begin() + b * (b - std::min<std::size_t>(b, 1)) / 2);
+    }
+}
+
+void nj_tree::build()
+{
+    joins.clear();
+    root.clear();
+    if(num < 3)
+    {
+	// no join needed
+	double len = num == 2 ? at(0, 1) / 2.0 : 0;
+	for(std::size_t i = 0; i < num; ++i)
+	{
+	    root.emplace_back(i, len);
+	}
+	return;
+    }
+
+    // slot s of the matrix holds node slot_node[s], a joined node takes the
+    // slot of its left child
+    std::vector<uint32_t> slot_node(num);
+    std::vector<long long> node_slot(2 * num, -1);
+    std::vector<std::size_t> active(num);
+    std::iota(slot_node.begin(), slot_node.end(), 0);
+    std::iota(node_slot.begin(), node_slot.begin() + num, 0);
+    std::iota(active.begin(), active.end(), 0);
+
+    // initially each row holds the slots after it, so each pair is in one
+    // row; a joined node holds all the active ones. Entries of removed
+    // nodes are skipped and dropped when a row is compacted.
+    std::vector<double> sums(num, 0);
+    std::vector<std::vector<entry> > sorted(num);
+    std::vector<std::size_t> compacted(num, num);
+#pragma omp parallel for schedule(dynamic, 64)
+    for(long long a = 0; a < static_cast<long long>(num); ++a)
+    {
+	double sum = 0;
+	for(std::size_t b = 0; b < num; ++b)
+	{
+	    if(b == std::size_t(a)) continue;
+	    sum += at(a, b);
+	    if(b > std::size_t(a)) sorted[a].push_back({at(a, b), uint32_t(b)});
+	}
+	sums[a] = sum;
+	std::sort(sorted[a].begin(), sorted[a].end());
+    }
+
+    for(std::size_t m = num; m > 3; --m)
+    {
+	double max_sum = -std::numeric_limits<double>::infinity();
+	for(std::size_t s : active)
+	{
+	    max_sum = std::max(max_sum, sums[s]);
+	}
+
+	// Q(a, b) = (m - 2) d(a, b) - sum(a) - sum(b), each row is searched in
+	// increasing distance until even the largest sum cannot beat the best
+	best_pair best = {std::numeric_limits<double>::infinity(), 0, 0};
+#pragma omp parallel
+	{
+	    best_pair local = best;
+#pragma omp for schedule(dynamic, 16)
+	    for(long long k = 0; k < static_cast<long long>(active.size()); ++k)
+	    {
+		std::size_t a = active[k];
+		std::vector<entry>& row = sorted[a];
+		if(2 * m < compacted[a])
+		{
+		    row.erase(std::remove_if(row.begin(), row.end(), [&](const entry& e)
+		    {
+			return node_slot[e.node] < 0;
+		    }), row.end());
+		    compacted[a] = m;
+		}
+
+		for(const entry& e : row)
+		{
+		    long long b = node_slot[e.node];
+		    if(b < 0) continue;
+
+		    double base = (m - 2) * double(e.dist) - sums[a];
+		    if(base - max_sum > local.q) break;
+
+		    best_pair x = {base - sums[b], std::min<std::size_t>(a, b), std::max<std::size_t>(a, b)};
+		    if(x < local) local = x;
+		}
+	    }
+#pragma omp critical
+	    if(local < best) best = local;
+	}
+
+	// join a and b into a new node in the slot of a
+	std::size_t a = best.a, b = best.b;
+	double dab = at(a, b);
+	double left_len = dab / 2 + (sums[a] - sums[b]) / (2.0 * (m - 2));
+	left_len = std::min(std::max(left_len, 0.0), std::max(dab, 0.0));
+	uint32_t node = num + joins.size();
+	joins.push_back({slot_node[a], slot_node[b], left_len, std::max(dab - left_len, 0.0)});
+
+	node_slot[slot_node[a]] = -1;
+	node_slot[slot_node[b]] = -1;
+	node_slot[node] = a;
+	slot_node[a] = node;
+	active.erase(std::find(active.begin(), active.end(), b));
+
+	double sum = 0;
+#pragma omp parallel for schedule(static) reduction(+:sum)
+	for(long long k = 0; k < static_cast<long long>(active.size()); ++k)
+	{
+	    std::size_t c = active[k];
+	    if(c == a) continue;
+	    float dac = at(a, c), dbc = at(b, c);
+	    float d = (dac + dbc - dab) / 2;
+	    at(a, c) = d;
+	    sums[c] += double(d) - dac - dbc;
+	    sum += d;
+	}
+	sums[a] = sum;
+
+	std::vector<entry>& row = sorted[a];
+	row.clear();
+	for(std::size_t c : active)
+	{
+	    if(c != a) row.push_back({at(a, c), slot_node[c]});
+	}
+	std::sort(row.begin(), row.end());
+	std::vector<entry>().swap(sorted[b]);
+	compacted[a] = m - 1;
+    }
+
+    // the last three nodes meet at the root
+    std::size_t x = active[0], y = active[1], z = active[2];
+    double dxy = at(x, y), dxz = at(x, z), dyz = at(y, z);
+    root.emplace_back(slot_node[x], std::max((dxy + dxz - dyz) / 2, 0.0));
+    root.emplace_back(slot_node[y], std::max((dxy + dyz - dxz) / 2, 0.0));
+    root.emplace_back(slot_node[z], std::max((dxz + dyz - dxy) / 2, 0.0));
+}
+
+void nj_tree::save_newick(const std::string& tree_file,
+			  const std::vector<std::string>& labels) const
+{
+    if(!labels.empty() && labels.size() != num)
+    {
+	std::cerr << "Error: " << labels.size() << " labels for "
+		  << num << " sketchings" << std::endl;
+	std::exit(1);
+    }
+
+    std::ofstream fout(tree_file);
+    if(!fout)
+    {
+	// throw std::runtime_error("Could not write to the file: " + tree_file);
+	std::cerr << "Error: could not write to the file: "
+		  << tree_file << std::endl;
+	std::exit(1);
+    }
+
+    // depth first without recursion, the tree can be as deep as it has
+    // leaves
+    struct frame
+    {
+	uint32_t node;
+	int next;
+	double len;
+    };
+    std::vector<frame> stack;
+
+    fout << '(';
+    for(std::size_t i = 0; i < root.size(); ++i)
+    {
+	if(i > 0) fout << ',';
+	stack.push_back({root[i].first, 0, root[i].second});
+	while(!stack.empty())
+	{
+	    frame& f = stack.back();
+	    if(f.node < num)
+	    {
+		if(labels.empty()) fout << f.node;
+		else fout << newick_name(labels[f.node]);
+		fout << ':' << f.len;
+		stack.pop_back();
+		continue;
+	    }
+
+	    const join& j = joins[f.node - num];
+	    if(f.next == 0)
+	    {
+		fout << '(';
+		f.next = 1;
+		stack.push_back({j.left, 0, j.left_len});
+	    }
+	    else if(f.next == 1)
+	    {
+		fout << ',';
+		f.next = 2;
+		stack.push_back({j.right, 0, j.right_len});
+	    }
+	    else
+	    {
+		fout << "):" << f.len;
+		stack.pop_back();
+	    }
+	}
+    }
+    fout << ");" << std::endl;
+    fout.close();
+}
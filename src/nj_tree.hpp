@@ -0,0 +1,78 @@
+/*
+  Part of SubseqSketch.
+  Neighbor-joining tree of the sketchings.
+  By Ke @ Penn State
+*/
+
+#ifndef __NJ_TREE_H__
+#define __NJ_TREE_H__
+
+#include "tiled_dist.hpp"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Neighbor-joining (Saitou & Nei, 1987) with the bounded search of
+// RapidNJ (Simonsen et al., 2008): the distances of each row are kept
+// sorted, so the search for the pair minimizing Q can stop in each row as
+// soon as no later entry can beat the best pair found, given the largest
+// row sum. The rows are searched and updated in parallel.
+//
+// The distances are held as floats in the packed upper triangle, as in
+// RapidNJ, and the row sums as doubles.
+class nj_tree
+{
+public:
+    // Distances between the rows of one sketching file.
+    explicit nj_tree(const tiled_dist& dist);
+
+    // Distances stored by dist (or show), the matrix must be square.
+    explicit nj_tree(const std::string& dist_file);
+
+    std::size_t size() const { return num; }
+
+    // Join the leaves into an unrooted tree.
+    void build();
+
+    // Write the tree in Newick format, leaves are named by labels if not
+    // empty, by their 0-based indices otherwise.
+    void save_newick(const std::string& tree_file,
+		     const std::vector<std::string>& labels) const;
+
+private:
+    // A joined pair of nodes, ids below num are leaves and id num + k is
+    // joins[k].
+    struct join
+    {
+	uint32_t left;
+	uint32_t right;
+	double left_len;
+	double right_len;
+    };
+
+    // A distance in a sorted row and the node it leads to.
+    struct entry
+    {
+	float dist;
+	uint32_t node;
+
+	bool operator<(const entry& x) const
+	{
+	    return dist < x.dist || (dist == x.dist && node < x.node);
+	}
+    };
+
+    std::size_t num;
+    std::vector<float> dists;
+    std::vector<join> joins;
+    // Children of the root and their branch lengths.
+    std::vector<std::pair<uint32_t, double> > root;
+
+    // d(a, b) for a != b, a and b are slots of the matrix.
+    float& at(std::size_t a, std::size_t b)
+    {
+	return a < b ? dists[b * (b - 1) / 2 + a] : dists[a * (a - 1) / 2 + b];
+    }
+};
+
+#endif
@@ -0,0 +1,75 @@
+/*
+  Part of SubseqSketch.
+  A sequence packed with 2 bits per character.
+  By Ke @ Penn State
+*/
+
+#include "packed_sequence.hpp"
+#include <algorithm>
+
+packed_sequence::packed_sequence()
+    : len(0), words(1, 0)
+{}
+
+void packed_sequence::clear()
+{
+    len = 0;
+    words.assign(1, 0);
+    gap_runs.clear();
+}
+
+void packed_sequence::append(const char* seq, std::size_t n, const int* codes)
+{
+    words.resize((len + n) / 32 + 2, 0);
+    std::size_t i = 0;
+    while(i < n)
+    {
+	// whole words are packed in a register when they have no gap
+	if(len % 32 == 0 && i + 32 <= n)
+	{
+	    uint64_t word = 0;
+	    int missing = 0;
+	    for(int k = 0; k < 32; ++k)
+	    {
+		int c = codes[static_cast<unsigned char>(seq[i + k])];
+		word = (word << 2) | (c & 3);
+		missing |= c;
+	    }
+	    if(missing >= 0)
+	    {
+		words[len / 32] = word;
+		i += 32;
+		len += 32;
+		continue;
+	    }
+	}
+
+	int c = codes[static_cast<unsigned char>(seq[i])];
+	if(c < 0)
+	{
+	    if(!gap_runs.empty() && gap_runs.back().second == len) ++gap_runs.back().second;
+	    else gap_runs.emplace_back(len, len + 1);
+	}
+	else
+	{
+	    words[len / 32] |= uint64_t(c) << (62 - 2 * (len % 32));
+	}
+	++i;
+	++len;
+    }
+}
+
+std::size_t packed_sequence::first_gap(std::size_t pos) const
+{
+    return std::upper_bound(gap_runs.begin(), gap_runs.end(), pos,
+			    [](std::size_t p, const std::pair<std::size_t, std::size_t>& g)
+			    {
+				return p < g.second;
+			    }) - gap_runs.begin();
+}
+
+std::size_t packed_sequence::memory() const
+{
+    return words.capacity() * sizeof(uint64_t) +
+	gap_runs.capacity() * sizeof(std::pair<std::size_t, std::size_t>);
+}
@@ -0,0 +1,63 @@
+/*
+  Part of SubseqSketch.
+  A sequence packed with 2 bits per character.
+  By Ke @ Penn State
+*/
+
+#ifndef __PACKED_SEQUENCE_H__
+#define __PACKED_SEQUENCE_H__
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+// Characters are stored as 2-bit codes (e.g., A=0, C=1, G=2, T=3), 32 per
+// 64-bit word with the first one in the highest bits, so the codes of the
+// up to 32 characters starting at any position are one shift away. The
+// characters without a code (e.g., N) are stored as 0 and recorded as
+// runs of positions on the side, so tokens overlapping them are skipped
+// exactly as with the plain text. Runs are used instead of a bitmap as
+// such characters are rare and clustered in sequencing data, the memory
+// stays close to 2 bits per character.
+class packed_sequence
+{
+public:
+    packed_sequence();
+
+    std::size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    void clear();
+    // Make room for n characters in total.
+    void reserve(std::size_t n) { words.reserve(n / 32 + 2); }
+
+    // Append n characters, codes maps a character to its code in [0, 4) or
+    // to a negative value for characters without a code.
+    void append(const char* seq, std::size_t n, const int* codes);
+
+    // The codes of the 32 characters starting at pos, the character at pos
+    // in the highest 2 bits. Positions past the end read as 0.
+    uint64_t window(std::size_t pos) const
+    {
+	std::size_t w = pos / 32;
+	int s = 2 * (pos % 32);
+	return s == 0 ? words[w] : (words[w] << s) | (words[w + 1] >> (64 - s));
+    }
+
+    // Runs [first, second) of characters without a code, in order.
+    const std::vector<std::pair<std::size_t, std::size_t> >& gaps() const { return gap_runs; }
+
+    // Index of the first gap ending after pos, gaps().size() if none.
+    std::size_t first_gap(std::size_t pos) const;
+
+    // Bytes held by the sequence.
+    std::size_t memory() const;
+
+private:
+    std::size_t len;
+    // One zero word is kept past the last character for window().
+    std::vector<uint64_t> words;
+    std::vector<std::pair<std::size_t, std::size_t> > gap_runs;
+};
+
+#endif
@@ -0,0 +1,229 @@
+/*
+  Part of SubseqSketch.
+  Clustering of the sketchings without the distance matrix.
+  By Ke @ Penn State
+*/
+
+#include "sketch_clusters.hpp"
+#include "tiled_dist.hpp"
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <limits>
+#include <mutex>
+#include <cstdlib>
+#include <omp.h>
+
+namespace
+{
+// Rows of a sketching file processed at a time.
+const std::size_t block_rows = 4096;
+
+// Blocks whose cluster sums are held at a time by k_medoids.
+const long long sum_batch = 64;
+
+// Root of x with path halving, the root of a set is its smallest member.
+std::size_t find_root(std::vector<std::size_t>& parent, std::size_t x)
+{
+    while(parent[x] != x)
+    {
+	parent[x] = parent[parent[x]];
+	x = parent[x];
+    }
+    return x;
+}
+
+void unite(std::vector<std::size_t>& parent, std::size_t a, std::size_t b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if(a < b) parent[b] = a;
+    else if(b < a) parent[a] = b;
+}
+
+// The best candidate medoid of a cluster, ties broken by the index.
+typedef std::pair<double, std::size_t> scored;
+
+bool better(const scored& x, const scored& y)
+{
+    return x.first > y.first || (x.first == y.first && x.second < y.second);
+}
+}
+
+std::vector<std::size_t> sketch_clusters::single_linkage(const sss_mapped& sketch,
+							 double max_dist, std::size_t tile)
+{
+    std::vector<std::size_t> parent(sketch.rows());
+    std::iota(parent.begin(), parent.end(), 0);
+
+    // each tile finds its close pairs on its own, then merges them
+    std::mutex lock;
+    tiled_dist(sketch, tile).for_each_tile([&](std::size_t i, std::size_t j, const Eigen::MatrixXd& dist)
+    {
+	std::vector<std::pair<std::size_t, std::size_t> > edges;
+	for(Eigen::Index c = 0; c < dist.cols(); ++c)
+	{
+	    for(Eigen::Index r = 0; r < dist.rows() && i + r < j + c; ++r)
+	    {
+		if(dist(r, c) <= max_dist) edges.emplace_back(i + r, j + c);
+	    }
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	for(const std::pair<std::size_t, std::size_t>& e : edges)
+	{
+	    unite(parent, e.first, e.second);
+	}
+    });
+
+    std::vector<std::size_t> clusters(sketch.rows());
+    for(std::size_t x = 0; x < clusters.size(); ++x)
+    {
+	clusters[x] = find_root(parent, x);
+    }
+
+    return clusters;
+}
+
+std::vector<std::size_t> sketch_clusters::k_medoids(const sss_mapped& sketch, std::size_t k,
+						    std::size_t max_iter, uint64_t seed,
+						    std::size_t& iterations)
+{
+    iterations = 0;
+    std::size_t num = sketch.rows();
+    std::size_t dim = sketch.cols();
+    k = std::min(k, num);
+    if(k == 0) return std::vector<std::size_t>(num, 0);
+    long long num_blocks = (num + block_rows - 1) / block_rows;
+
+    // k-means++: each new medoid is drawn with probability proportional to
+    // the squared distance to the closest medoid so far
+    std::mt19937_64 rng(seed);
+    std::vector<std::size_t> medoids(1, std::uniform_int_distribution<std::size_t>(0, num - 1)(rng));
+    Eigen::MatrixXd centers(k, dim);
+    std::vector<double> min_dist(num, std::numeric_limits<double>::infinity());
+    for(std::size_t c = 0; c < k; ++c)
+    {
+	centers.row(c) = sketch.normalized_block<double>(medoids[c], 1);
+	if(c + 1 == k) break;
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for(long long b = 0; b < num_blocks; ++b)
+	{
+	    std::size_t first = b * block_rows;
+	    Eigen::MatrixXd rows = sketch.normalized_block<double>(first, std::min(block_rows, num - first));
+	    Eigen::VectorXd sim = rows * centers.row(c).transpose();
+	    for(Eigen::Index r = 0; r < sim.size(); ++r)
+	    {
+		min_dist[first + r] = std::min(min_dist[first + r], std::max(0.0, 1 - sim[r]));
+	    }
+	}
+
+	// summed in order so that the draw does not depend on the threads
+	double total = 0;
+	for(double d : min_dist)
+	{
+	    total += d * d;
+	}
+	std::size_t next = 0;
+	if(total > 0)
+	{
+	    double u = std::uniform_real_distribution<double>(0, total)(rng);
+	    for(double acc = 0; next + 1 < num; ++next)
+	    {
+		acc += min_dist[next] * min_dist[next];
+		if(acc > u && min_dist[next] > 0) break;
+	    }
+	}
+	else
+	{
+	    // fewer distinct sketchings than k, any unused one will do
+	    while(std::find(medoids.begin(), medoids.end(), next) != medoids.end()) ++next;
+	}
+	medoids.push_back(next);
+    }
+
+    std::vector<uint32_t> labels(num);
+    while(true)
+    {
+	// assign each sketching to the closest medoid and sum the normalized
+	// members of each cluster, one sum per block added in block order so
+	// that the sums do not depend on the threads
+	Eigen::MatrixXd sums = Eigen::MatrixXd::Zero(k, dim);
+	for(long long batch = 0; batch < num_blocks; batch += sum_batch)
+	{
+	    long long end = std::min<long long>(num_blocks, batch + sum_batch);
+	    std::vector<Eigen::MatrixXd> block_sums(end - batch);
+#pragma omp parallel for schedule(dynamic, 1)
+	    for(long long b = batch; b < end; ++b)
+	    {
+		std::size_t first = b * block_rows;
+		Eigen::MatrixXd rows = sketch.normalized_block<double>(first, std::min(block_rows, num - first));
+		Eigen::MatrixXd sim = rows * centers.transpose();
+		Eigen::MatrixXd& local = block_sums[b - batch];
+		local.setZero(k, dim);
+		for(Eigen::Index r = 0; r < rows.rows(); ++r)
+		{
+		    Eigen::Index c;
+		    sim.row(r).maxCoeff(&c);
+		    labels[first + r] = c;
+		    local.row(c) += rows.row(r);
+		}
+	    }
+	    for(const Eigen::MatrixXd& x : block_sums)
+	    {
+		sums += x;
+	    }
+	}
+
+	if(++iterations >= max_iter) break;
+
+	// the member closest to all the others in each cluster, the best of
+	// each block are merged in block order
+	std::vector<std::vector<scored> > block_best(num_blocks);
+#pragma omp parallel for schedule(dynamic, 1)
+	for(long long b = 0; b < num_blocks; ++b)
+	{
+	    std::size_t first = b * block_rows;
+	    Eigen::MatrixXd rows = sketch.normalized_block<double>(first, std::min(block_rows, num - first));
+	    std::vector<scored>& local = block_best[b];
+	    local.assign(k, scored(-std::numeric_limits<double>::infinity(), num));
+	    for(Eigen::Index r = 0; r < rows.rows(); ++r)
+	    {
+		uint32_t c = labels[first + r];
+		scored x(rows.row(r).dot(sums.row(c)), first + r);
+		if(better(x, local[c])) local[c] = x;
+	    }
+	}
+	std::vector<scored> best(k, scored(-std::numeric_limits<double>::infinity(), num));
+	for(const std::vector<scored>& local : block_best)
+	{
+	    for(std::size_t c = 0; c < k; ++c)
+	    {
+		if(better(local[c], best[c])) best[c] = local[c];
+	    }
+	}
+
+	bool changed = false;
+	for(std::size_t c = 0; c < k; ++c)
+	{
+	    // an empty cluster keeps its medoid
+	    if(best[c].second < num && best[c].second != medoids[c])
+	    {
+		medoids[c] = best[c].second;
+		centers.row(c) = sketch.normalized_block<double>(medoids[c], 1);
+		changed = true;
+	    }
+	}
+	if(!changed) break;
+    }
+
+    std::vector<std::size_t> clusters(num);
+    for(std::size_t x = 0; x < num; ++x)
+    {
+	clusters[x] = medoids[labels[x]];
+    }
+
+    return clusters;
+}
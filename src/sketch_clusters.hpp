@@ -0,0 +1,36 @@
+/*
+  Part of SubseqSketch.
+  Clustering of the sketchings without the distance matrix.
+  By Ke @ Penn State
+*/
+
+#ifndef __SKETCH_CLUSTERS_H__
+#define __SKETCH_CLUSTERS_H__
+
+#include "sss_mapped.hpp"
+#include <vector>
+#include <cstdint>
+
+// Each sketching is assigned to a cluster named by one of its members: the
+// smallest index for single-linkage, the medoid for k-medoids. Neither
+// method holds more than a block of distances at a time.
+class sketch_clusters
+{
+public:
+    // Connected components of the graph linking the sketchings within
+    // max_dist of each other, the distances are computed tile by tile and
+    // merged into a union-find.
+    static std::vector<std::size_t> single_linkage(const sss_mapped& sketch,
+						   double max_dist, std::size_t tile);
+
+    // k-medoids by alternating assignment and medoid updates from a
+    // k-means++ seeding. With the cosine distance the medoid of a cluster
+    // is the member with the largest dot product with the sum of the
+    // normalized members, so each iteration takes two passes over the
+    // sketchings. iterations is set to the number of iterations run.
+    static std::vector<std::size_t> k_medoids(const sss_mapped& sketch, std::size_t k,
+					      std::size_t max_iter, uint64_t seed,
+					      std::size_t& iterations);
+};
+
+#endif
@@ -0,0 +1,297 @@
+/*
+  Part of SubseqSketch.
+  Sparse matrix of the sketching distances within a radius.
+  By Ke @ Penn State
+*/
+
+#include "sparse_dist.hpp"
+#include "sss_array.hpp"
+#include "gzip_stream.hpp"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+
+namespace
+{
+const char sparse_magic[8] = {'S', 'S', 'S', 'P', 'A', 'R', 'S', 'E'};
+const uint32_t sparse_version = 1;
+
+void put16(std::string& out, uint16_t x)
+{
+    out += static_cast<char>(x & 0xff);
+    out += static_cast<char>(x >> 8);
+}
+
+void put32(std::string& out, uint32_t x)
+{
+    put16(out, x & 0xffff);
+    put16(out, x >> 16);
+}
+
+// Write stored (uncompressed) files to a zip archive, as numpy.savez does.
+class zip_writer
+{
+public:
+    zip_writer(const std::string& file)
+	: file(file), fout(file, std::ios::binary), offset(0), count(0)
+    {
+	if(!fout)
+	{
+	    std::cerr << "Error: could not write to the file: "
+		      << file << std::endl;
+	    std::exit(1);
+	}
+    }
+
+    // Add name with content header followed by len bytes of data.
+    void add(const std::string& name, const std::string& header,
+	     const char* data, std::size_t len)
+    {
+	std::size_t size = header.size() + len;
+	if(size >= 0xffffffffULL || offset >= 0xffffffffULL)
+	{
+	    std::cerr << "Error: " << name << " is too large for an npz file: "
+		      << file << std::endl;
+	    std::exit(1);
+	}
+	uint32_t crc = gzip_stream::crc32(0, header.data(), header.size());
+	crc = gzip_stream::crc32(crc, data, len);
+
+	// local file header
+	std::string local;
+	put32(local, 0x04034b50);
+	std::string common = fields(crc, size, name);
+	local += common + name;
+	fout << local << header;
+	fout.write(data, len);
+
+	// central directory entry
+	put32(central, 0x02014b50);
+	put16(central, 20);
+	central += common;
+	put16(central, 0);
+	put16(central, 0);
+	put16(central, 0);
+	put32(central, 0);
+	put32(central, offset);
+	central += name;
+
+	offset += local.size() + size;
+	++count;
+    }
+
+    void close()
+    {
+	// the central directory must also start within the 32-bit offsets
+	if(offset >= 0xffffffffULL)
+	{
+	    std::cerr << "Error: the arrays are too large for an npz file: "
+		      << file << std::endl;
+	    std::exit(1);
+	}
+
+	std::string end;
+	put32(end, 0x06054b50);
+	put16(end, 0);
+	put16(end, 0);
+	put16(end, count);
+	put16(end, count);
+	put32(end, central.size());
+	put32(end, offset);
+	put16(end, 0);
+	fout << central << end;
+	fout.close();
+    }
+
+private:
+    std::string file;
+    std::ofstream fout;
+    std::size_t offset;
+    int count;
+    std::string central;
+
+    // Fields shared by the local header and the central directory entry,
+    // from version needed to extract to extra field length.
+    static std::string fields(uint32_t crc, std::size_t size, const std::string& name)
+    {
+	std::string out;
+	put16(out, 20);
+	put16(out, 0);
+	put16(out, 0);
+	put16(out, 0);
+	// 1980-01-01
+	put16(out, 0x21);
+	put32(out, crc);
+	put32(out, size);
+	put32(out, size);
+	put16(out, name.size());
+	put16(out, 0);
+	return out;
+    }
+};
+
+template<typename T>
+void read_array(std::ifstream& fin, std::vector<T>& v, std::size_t n)
+{
+    v.resize(n);
+    fin.read(reinterpret_cast<char*>(v.data()), sizeof(T) * n);
+}
+
+template<typename T>
+void write_array(std::ofstream& fout, const std::vector<T>& v)
+{
+    fout.write(reinterpret_cast<const char*>(v.data()), sizeof(T) * v.size());
+}
+}
+
+sparse_dist::sparse_dist(std::size_t rows, std::size_t cols, double max_dist,
+			 uint32_t flags)
+    : rows(rows), cols(cols), max_dist(max_dist), flags(flags),
+      indptr(rows + 1, 0)
+{}
+
+bool sparse_dist::is_sparse_file(const std::string& file)
+{
+    std::ifstream fin(file, std::ios::binary);
+    char magic[sizeof(sparse_magic)];
+    fin.read(magic, sizeof(magic));
+    return fin && std::equal(magic, magic + sizeof(magic), sparse_magic);
+}
+
+void sparse_dist::save(const std::string& file) const
+{
+    std::ofstream fout(file, std::ios::binary);
+    if(!fout)
+    {
+	// throw std::runtime_error("Could not write to the file: " + file);
+	std::cerr << "Error: could not write to the file: "
+		  << file << std::endl;
+	std::exit(1);
+    }
+
+    uint64_t dims[3] = {rows, cols, nnz()};
+    fout.write(sparse_magic, sizeof(sparse_magic));
+    fout.write(reinterpret_cast<const char*>(&sparse_version), sizeof(sparse_version));
+    fout.write(reinterpret_cast<const char*>(&flags), sizeof(flags));
+    fout.write(reinterpret_cast<const char*>(dims), sizeof(dims));
+    fout.write(reinterpret_cast<const char*>(&max_dist), sizeof(max_dist));
+    write_array(fout, indptr);
+    write_array(fout, indices);
+    write_array(fout, data);
+    fout.close();
+}
+
+sparse_dist sparse_dist::load(const std::string& file)
+{
+    std::ifstream fin(file, std::ios::binary);
+    if(!fin || !is_sparse_file(file))
+    {
+	std::cerr << "Error: could not open the sparse distance file: "
+		  << file << std::endl;
+	std::exit(1);
+    }
+
+    uint32_t version, flags;
+    uint64_t dims[3];
+    double max_dist;
+    fin.seekg(sizeof(sparse_magic));
+    fin.read(reinterpret_cast<char*>(&version), sizeof(version));
+    fin.read(reinterpret_cast<char*>(&flags), sizeof(flags));
+    fin.read(reinterpret_cast<char*>(dims), sizeof(dims));
+    fin.read(reinterpret_cast<char*>(&max_dist), sizeof(max_dist));
+    if(!fin || version > sparse_version)
+    {
+	std::cerr << "Error: unsupported sparse distance file (version "
+		  << version << "): " << file << std::endl;
+	std::exit(1);
+    }
+
+    // the arrays must fill the rest of the file exactly, checked before
+    // they are allocated
+    std::streamoff header_end = fin.tellg();
+    fin.seekg(0, std::ios::end);
+    uint64_t payload = fin.tellg() - header_end;
+    fin.seekg(header_end);
+    const uint64_t entry_bytes = sizeof(uint32_t) + sizeof(double);
+    if(!fin || dims[0] >= payload / sizeof(uint64_t) || dims[2] > payload / entry_bytes ||
+       (dims[0] + 1) * sizeof(uint64_t) + dims[2] * entry_bytes != payload)
+    {
+	std::cerr << "Error: the sparse distance file is truncated: "
+		  << file << std::endl;
+	std::exit(1);
+    }
+
+    sparse_dist dist(dims[0], dims[1], max_dist, flags);
+    read_array(fin, dist.indptr, dims[0] + 1);
+    read_array(fin, dist.indices, dims[2]);
+    read_array(fin, dist.data, dims[2]);
+    if(!fin)
+    {
+	std::cerr << "Error: the sparse distance file is truncated: "
+		  << file << std::endl;
+	std::exit(1);
+    }
+
+    // the rows must be contiguous ranges of entries with columns in range
+    bool valid = dist.indptr.front() == 0 && dist.indptr.back() == dims[2];
+    for(std::size_t i = 0; valid && i < dist.rows; ++i)
+    {
+	valid = dist.indptr[i] <= dist.indptr[i + 1];
+    }
+    for(std::size_t p = 0; valid && p < dist.indices.size(); ++p)
+    {
+	valid = dist.indices[p] < dist.cols;
+    }
+    if(!valid)
+    {
+	std::cerr << "Error: the sparse distance file is corrupted: "
+		  << file << std::endl;
+	std::exit(1);
+    }
+
+    return dist;
+}
+
+void sparse_dist::show() const
+{
+    for(std::size_t i = 0; i < rows; ++i)
+    {
+	for(uint64_t p = indptr[i]; p < indptr[i + 1]; ++p)
+	{
+	    std::cout << i << '\t' << indices[p] << '\t' << data[p] << '\n';
+	}
+    }
+    std::cout.flush();
+}
+
+void sparse_dist::save_npz(const std::string& file) const
+{
+    // the arrays stored by scipy.sparse.save_npz for a csr_matrix, whose
+    // indices are signed
+    if(cols > 0x7fffffffULL)
+    {
+	std::cerr << "Error: too many columns for an npz file: "
+		  << file << std::endl;
+	std::exit(1);
+    }
+
+    zip_writer zip(file);
+    zip.add("indices.npy",
+	    sss_array::npy_header("<i4", false, "(" + std::to_string(nnz()) + ",)"),
+	    reinterpret_cast<const char*>(indices.data()), sizeof(uint32_t) * nnz());
+    zip.add("indptr.npy",
+	    sss_array::npy_header("<i8", false, "(" + std::to_string(rows + 1) + ",)"),
+	    reinterpret_cast<const char*>(indptr.data()), sizeof(uint64_t) * indptr.size());
+    zip.add("format.npy", sss_array::npy_header("|S3", false, "()"), "csr", 3);
+
+    int64_t shape[2] = {static_cast<int64_t>(rows), static_cast<int64_t>(cols)};
+    zip.add("shape.npy", sss_array::npy_header("<i8", false, "(2,)"),
+	    reinterpret_cast<const char*>(shape), sizeof(shape));
+    zip.add("data.npy",
+	    sss_array::npy_header("<f8", false, "(" + std::to_string(nnz()) + ",)"),
+	    reinterpret_cast<const char*>(data.data()), sizeof(double) * nnz());
+    zip.close();
+
+    std::cout << "Sparse distance matrix wrote to the file: " << file << std::endl;
+}
@@ -0,0 +1,51 @@
+/*
+  Part of SubseqSketch.
+  Sparse matrix of the sketching distances within a radius.
+  By Ke @ Penn State
+*/
+
+#ifndef __SPARSE_DIST_H__
+#define __SPARSE_DIST_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Distances not larger than max_dist in compressed sparse row format.
+// The binary file (.sss-sparse) starts with a 48-byte header: SSSPARSE,
+// version(uint32), flags(uint32), rows(uint64), cols(uint64), nnz(uint64)
+// and max_dist(double), followed by indptr (rows + 1 uint64), indices
+// (nnz uint32) and data (nnz double).
+class sparse_dist
+{
+public:
+    // If the distances are within one file, only the pairs with
+    // row < col are stored.
+    enum { UPPER_TRIANGLE = 1 };
+
+    std::size_t rows;
+    std::size_t cols;
+    double max_dist;
+    uint32_t flags;
+    std::vector<uint64_t> indptr;
+    std::vector<uint32_t> indices;
+    std::vector<double> data;
+
+    sparse_dist(std::size_t rows, std::size_t cols, double max_dist, uint32_t flags);
+
+    std::size_t nnz() const { return indices.size(); }
+
+    // Whether file is written by save.
+    static bool is_sparse_file(const std::string& file);
+
+    void save(const std::string& file) const;
+    static sparse_dist load(const std::string& file);
+
+    // Output one row, col, distance triple per line to std::cout.
+    void show() const;
+
+    // Write an npz file which can be loaded by scipy.sparse.load_npz.
+    void save_npz(const std::string& file) const;
+};
+
+#endif
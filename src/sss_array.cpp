@@ -6,9 +6,70 @@
 
 #include "sss_array.hpp"
 #include <string>
+#include <cstdint>
+#include <algorithm>
 
-void sss_array::write_all(const Eigen::MatrixXi& sketches, size_t num_sketches,
-			  int sketch_len, int max_val,
+namespace
+{
+const char sss_magic[8] = {'S', 'S', 'S', 'K', 'E', 'T', 'C', 'H'};
+const uint32_t sss_version = 3;
+const uint32_t sss_byte_order = 0x01020304;
+
+// Convert rows of sketches to row-major cells of type T and append them
+// to buf.
+template<typename T>
+void pack_rows(const Eigen::MatrixXi& rows, std::vector<char>& buf)
+{
+    size_t st = buf.size();
+    buf.resize(st + sizeof(T) * rows.size());
+    T* cells = reinterpret_cast<T*>(buf.data() + st);
+    for(Eigen::Index i = 0; i < rows.rows(); ++i)
+    {
+	for(Eigen::Index j = 0; j < rows.cols(); ++j)
+	{
+	    *cells++ = static_cast<T>(rows(i, j));
+	}
+    }
+}
+
+// Read num_sketches x sketch_len cells of type T into sketches.
+template<typename T>
+void unpack_rows(std::ifstream& fin, int layout, Eigen::MatrixXi& sketches)
+{
+    if(layout == SSS_ROW_MAJOR)
+    {
+	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> cells(sketches.rows(), sketches.cols());
+	fin.read(reinterpret_cast<char*>(cells.data()), sizeof(T) * cells.size());
+	sketches = cells.template cast<int>();
+    }
+    else
+    {
+	Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> cells(sketches.rows(), sketches.cols());
+	fin.read(reinterpret_cast<char*>(cells.data()), sizeof(T) * cells.size());
+	sketches = cells.template cast<int>();
+    }
+}
+}
+
+static_assert(sizeof(sss_header) == 64, "sss_header must take 64 bytes");
+
+sss_header::sss_header()
+    : sss_header(0, 0, 0, 0, 0)
+{}
+
+sss_header::sss_header(size_t num_sketches, int sketch_len, int max_val,
+		       int token_len, uint64_t subseq_hash)
+    : version(sss_version), byte_order(sss_byte_order),
+      num_sketches(num_sketches), sketch_len(sketch_len), max_val(max_val),
+      token_len(token_len), cell_bytes(sss_array::cell_bytes(max_val)),
+      layout(SSS_ROW_MAJOR), flags(0), subseq_hash(subseq_hash)
+{
+    std::copy(sss_magic, sss_magic + sizeof(sss_magic), magic);
+    std::fill(reserved, reserved + sizeof(reserved), 0);
+}
+
+void sss_array::write_all(const Eigen::MatrixXi& sketches,
+			  const sss_header& header,
 			  const std::string& sketch_file)
 {
     std::ofstream fout(sketch_file, std::ios::binary);
@@ -19,19 +80,70 @@ void sss_array::write_all(const Eigen::MatrixXi& sketches, size_t num_sketches,
 	std::exit(1);
     }
     
-    fout.write(reinterpret_cast<const char*>(&num_sketches), sizeof(num_sketches));
-    fout.write(reinterpret_cast<const char*>(&sketch_len), sizeof(sketch_len));
-    fout.write(reinterpret_cast<const char*>(&max_val), sizeof(max_val));
-
-    fout.write(reinterpret_cast<const char*>(sketches.data()), sizeof(int) * num_sketches * sketch_len);
+    sss_header with_norms = header;
+    with_norms.flags |= SSS_HAS_NORMS;
+    write_header(with_norms, fout);
+    write_rows(sketches, header, fout);
+
+    std::vector<uint64_t> sq_norms;
+    squared_norms(sketches, sq_norms);
+    write_norms(sq_norms, fout);
     fout.close();
 }
 
-Eigen::MatrixXi
-sss_array::load_all(size_t& num_sketches,
-		    int& sketch_len,
-		    int& max_val,
-		    const std::string& sketch_file)
+int sss_array::cell_bytes(int max_val)
+{
+    if(max_val <= 0xff) return 1;
+    if(max_val <= 0xffff) return 2;
+    return 4;
+}
+
+void sss_array::write_header(const sss_header& header, std::ofstream& fout)
+{
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+void sss_array::write_rows(const Eigen::MatrixXi& rows,
+			   const sss_header& header,
+			   std::ofstream& fout)
+{
+    std::vector<char> buf;
+    switch(header.cell_bytes)
+    {
+    case 1: pack_rows<uint8_t>(rows, buf); break;
+    case 2: pack_rows<uint16_t>(rows, buf); break;
+    default: pack_rows<int32_t>(rows, buf); break;
+    }
+    fout.write(buf.data(), buf.size());
+}
+
+void sss_array::squared_norms(const Eigen::MatrixXi& rows,
+			      std::vector<uint64_t>& sq_norms)
+{
+    for(Eigen::Index i = 0; i < rows.rows(); ++i)
+    {
+	sq_norms.push_back(rows.row(i).cast<int64_t>().squaredNorm());
+    }
+}
+
+void sss_array::write_norms(const std::vector<uint64_t>& sq_norms,
+			    std::ofstream& fout)
+{
+    size_t pos = fout.tellp();
+    size_t padding = (8 - pos % 8) % 8;
+    const char zeros[8] = {0};
+    fout.write(zeros, padding);
+    fout.write(reinterpret_cast<const char*>(sq_norms.data()),
+	       sizeof(uint64_t) * sq_norms.size());
+}
+
+size_t sss_array::norms_offset(const sss_header& header, size_t payload_offset)
+{
+    size_t end = payload_offset + header.num_sketches * header.sketch_len * header.cell_bytes;
+    return (end + 7) / 8 * 8;
+}
+
+size_t sss_array::read_header(const std::string& sketch_file, sss_header& header)
 {
     std::ifstream fin(sketch_file, std::ios::binary);
 
@@ -42,19 +154,105 @@ sss_array::load_all(size_t& num_sketches,
 		  << sketch_file << std::endl;
 	std::exit(1);
     }
-    
-    fin.read(reinterpret_cast<char*>(&num_sketches), sizeof(num_sketches));
-    fin.read(reinterpret_cast<char*>(&sketch_len), sizeof(sketch_len));
-    fin.read(reinterpret_cast<char*>(&max_val), sizeof(max_val));
 
-    Eigen::MatrixXi sketches(num_sketches, sketch_len);
+    header = sss_header();
+    size_t offset;
 
-    fin.read(reinterpret_cast<char*>(sketches.data()), sizeof(int) * num_sketches * sketch_len);
+    char magic[sizeof(sss_magic)];
+    fin.read(magic, sizeof(magic));
+    if(!fin || !std::equal(magic, magic + sizeof(magic), sss_magic))
+    {
+	// original format
+	size_t num_sketches;
+	int sketch_len, max_val;
+	fin.clear();
+	fin.seekg(0);
+	fin.read(reinterpret_cast<char*>(&num_sketches), sizeof(num_sketches));
+	fin.read(reinterpret_cast<char*>(&sketch_len), sizeof(sketch_len));
+	fin.read(reinterpret_cast<char*>(&max_val), sizeof(max_val));
+
+	header = sss_header(num_sketches, sketch_len, max_val, 0, 0);
+	header.version = 1;
+	header.cell_bytes = sizeof(int);
+	header.layout = SSS_COL_MAJOR;
+	offset = sizeof(num_sketches) + sizeof(sketch_len) + sizeof(max_val);
+    }
+    else
+    {
+	fin.seekg(0);
+	fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if(header.version == sss_version && header.byte_order != sss_byte_order)
+	{
+	    std::cerr << "Error: " << sketch_file
+		      << " was written on a machine with a different byte order"
+		      << std::endl;
+	    std::exit(1);
+	}
+	offset = sizeof(header);
+    }
+
+    if(!fin || (header.version != 1 && header.version != sss_version) ||
+       (header.cell_bytes != 1 && header.cell_bytes != 2 && header.cell_bytes != 4))
+    {
+	std::cerr << "Error: unsupported sketching file format (version "
+		  << header.version << ", cell size " << int(header.cell_bytes)
+		  << "): " << sketch_file << std::endl;
+	std::exit(1);
+    }
+
+    return offset;
+}
+
+Eigen::MatrixXi sss_array::load_all(sss_header& header,
+				    const std::string& sketch_file)
+{
+    size_t offset = read_header(sketch_file, header);
+
+    std::ifstream fin(sketch_file, std::ios::binary);
+    fin.seekg(offset);
+
+    Eigen::MatrixXi sketches(header.num_sketches, header.sketch_len);
+    switch(header.cell_bytes)
+    {
+    case 1: unpack_rows<uint8_t>(fin, header.layout, sketches); break;
+    case 2: unpack_rows<uint16_t>(fin, header.layout, sketches); break;
+    default: unpack_rows<int32_t>(fin, header.layout, sketches); break;
+    }
     fin.close();
 
     return sketches;
 }
 
+void sss_array::check_compatible(const sss_header& header1,
+				 const std::string& sketch_file1,
+				 const sss_header& header2,
+				 const std::string& sketch_file2)
+{
+    if(header1.sketch_len != header2.sketch_len)
+    {
+	std::cerr << "Error: sketching dimensions do not match, "
+		  << sketch_file1 << ": " << header1.sketch_len << ", "
+		  << sketch_file2 << ": " << header2.sketch_len << std::endl;
+	std::exit(1);
+    }
+
+    if(header1.subseq_hash != 0 && header2.subseq_hash != 0 &&
+       header1.subseq_hash != header2.subseq_hash)
+    {
+	std::cerr << "Error: " << sketch_file1 << " and " << sketch_file2
+		  << " are sketched with different subsequences" << std::endl;
+	std::exit(1);
+    }
+
+    if(header1.max_val != header2.max_val)
+    {
+	std::cerr << "Warning: max possible values in the sketchings are not consistent, "
+		  << sketch_file1 << ": " << header1.max_val << ", "
+		  << sketch_file2 << ": " << header2.max_val
+		  << ". The results may not be meaningful." << std::endl;
+    }
+}
+
 
 void sss_array::write(const int* sketch, int size, int max_val,
 		      std::ofstream& fout)
@@ -165,18 +363,15 @@ void sss_array::pairwise_cos_dist(const std::vector<int*>& sketch1,
 }
 
 
-void sss_array::pairwise_cos_dist(const Eigen::MatrixXi& sketch1,
-				  const Eigen::MatrixXi& sketch2,
+void sss_array::pairwise_cos_dist(Eigen::MatrixXd& sketch1,
+				  Eigen::MatrixXd& sketch2,
 				  const std::string& dist_file)
 {
-    Eigen::MatrixXd normalized1 = sketch1.cast<double>();
-    normalized1.rowwise().normalize();
-    Eigen::MatrixXd normalized2 = sketch2.cast<double>();
-    normalized2.rowwise().normalize();
-    normalized2.transposeInPlace();
+    sketch1.rowwise().normalize();
+    sketch2.rowwise().normalize();
     
     Eigen::MatrixXd dist(sketch1.rows(), sketch2.rows());
-    dist.noalias() = normalized1 * normalized2;
+    dist.noalias() = sketch1 * sketch2.transpose();
     dist.array() = 1 - dist.array();
     double zero_threshold = 1e-8;
     dist = (dist.array() < zero_threshold).select(0.0f, dist);
@@ -256,17 +451,9 @@ void sss_array::show_dist_matrix(const Eigen::MatrixXd& dist)
     std::cout << dist.format(fmt) << std::endl;
 }
 
-void sss_array::save_dist_matrix_to_npy(const Eigen::MatrixXd& dist,
-					const std::string& dist_file)
+std::string sss_array::npy_header(const std::string& descr, bool fortran_order,
+				  const std::string& shape)
 {
-    std::ofstream fout(dist_file, std::ios::binary);
-    if(!fout)
-    {
-	std::cerr << "Error: could not write to the file: "
-		  << dist_file << std::endl;
-	std::exit(1);
-    }
-
     /*
       The first 6 bytes are a magic string: exactly \x93NUMPY.
 
@@ -281,25 +468,40 @@ void sss_array::save_dist_matrix_to_npy(const Eigen::MatrixXd& dist,
     
     // NPY magic number and version
     const char npy_magic[] = { '\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0};
-    fout.write(npy_magic, sizeof(npy_magic));
+    std::string out(npy_magic, sizeof(npy_magic));
 
     // Create the header
-    std::string header = "{'descr': '<f8', 'fortran_order': True, 'shape': (" 
-	+ std::to_string(dist.rows()) + ", "
-	+ std::to_string(dist.cols()) + "), }";
+    std::string header = "{'descr': '" + descr + "', 'fortran_order': "
+	+ (fortran_order ? "True" : "False") + ", 'shape': " + shape + ", }";
 
-    int len = sizeof(npy_magic) + 2 + header.size();
-    int padding_len =  (64 - (header.size() % 64)) % 64;
+    int len = sizeof(npy_magic) + 2 + header.size() + 1;
+    int padding_len = (64 - (len % 64)) % 64;
     std::string padding(padding_len, '\x20');
 
-    // Write header length
+    // Header length
     uint16_t header_len = static_cast<uint16_t>(header.size() + padding_len + 1);
-    uint8_t header_len_le[2] = {static_cast<uint8_t>(header_len & 0xff),
-				static_cast<uint8_t>((header_len >> 8) & 0xff)};
-    fout.write(reinterpret_cast<char*>(header_len_le), 2);
+    out += static_cast<char>(header_len & 0xff);
+    out += static_cast<char>((header_len >> 8) & 0xff);
+
+    // Header with padding
+    out += header + padding + '\n';
+
+    return out;
+}
+
+void sss_array::save_dist_matrix_to_npy(const Eigen::MatrixXd& dist,
+					const std::string& dist_file)
+{
+    std::ofstream fout(dist_file, std::ios::binary);
+    if(!fout)
+    {
+	std::cerr << "Error: could not write to the file: "
+		  << dist_file << std::endl;
+	std::exit(1);
+    }
 
-    // Write header with padding
-    fout << header << padding << '\n';
+    fout << npy_header("<f8", true, "(" + std::to_string(dist.rows()) + ", "
+		       + std::to_string(dist.cols()) + ")");
 
     // Write the data
     fout.write(reinterpret_cast<const char*>(dist.data()), dist.size() * sizeof(double));
@@ -10,26 +10,97 @@
 #include <fstream>
 #include <iostream>
 #include <vector>
+#include <cstdint>
 #include <Eigen/Dense>
 
+// Header of a sketching file, stored as is in the first 64 bytes of the
+// file so that the payload right after it is aligned.
+struct sss_header
+{
+    // SSSKETCH
+    char magic[8];
+    uint32_t version;
+    // 0x01020304 in the byte order of the host writing the file.
+    uint32_t byte_order;
+    uint64_t num_sketches;
+    int32_t sketch_len;
+    // Max possible value of a sketch, i.e., number of tokens per subsequence.
+    int32_t max_val;
+    int32_t token_len;
+    // Number of bytes per value and SSS_ROW_MAJOR or SSS_COL_MAJOR.
+    uint8_t cell_bytes;
+    uint8_t layout;
+    // SSS_HAS_NORMS if the squared norms of the sketchings (uint64) follow
+    // the payload, starting at the next multiple of 8 bytes.
+    uint16_t flags;
+    // Fingerprint of the subsequences used for sketching, 0 if unknown.
+    uint64_t subseq_hash;
+    char reserved[16];
+
+    sss_header();
+    sss_header(size_t num_sketches, int sketch_len, int max_val,
+	       int token_len, uint64_t subseq_hash);
+};
+
+enum { SSS_ROW_MAJOR = 0, SSS_COL_MAJOR = 1 };
+enum { SSS_HAS_NORMS = 1 };
+
 class sss_array
 {
 public:
     // Write a sketching matrix to file in binary format, dimension is
-    // num_sketches x sketch_len, each row is the sketching of one sequence
+    // num_sketches x sketch_len, each row is the sketching of one sequence.
+    // The file starts with the 64-byte header, rows are then stored one
+    // after another, each value takes the smallest of 1, 2 or 4 bytes that
+    // can hold max_val. The squared norms of the rows are stored at last.
     static void write_all(const Eigen::MatrixXi& sketches,
-			  size_t num_sketches,
-			  int sketch_len,
-			  int max_val,
+			  const sss_header& header,
 			  const std::string& sketch_file);
 
-    // Load a binary file with an sketching matrix. The first three
-    // values are assumbed to be num_sketches(size_t), sketch_len(int),
-    // and max_val(int)
-    static Eigen::MatrixXi load_all(size_t& num_sketches,
-				    int& sketch_len,
-				    int& max_val,
+    // Write the header of a sketching file whose rows are appended later
+    // by write_rows. If num_sketches is not known in advance, the header
+    // can be written again at the beginning of the file at the end.
+    static void write_header(const sss_header& header, std::ofstream& fout);
+
+    // Append rows to a sketching file.
+    static void write_rows(const Eigen::MatrixXi& rows,
+			   const sss_header& header,
+			   std::ofstream& fout);
+
+    // Append the squared norms of rows to sq_norms.
+    static void squared_norms(const Eigen::MatrixXi& rows,
+			      std::vector<uint64_t>& sq_norms);
+
+    // Append the squared norms of all rows after the last row, the
+    // header should then be written with the SSS_HAS_NORMS flag.
+    static void write_norms(const std::vector<uint64_t>& sq_norms,
+			    std::ofstream& fout);
+
+    // Offset of the squared norms in a file whose payload starts at
+    // payload_offset.
+    static size_t norms_offset(const sss_header& header, size_t payload_offset);
+
+    // Number of bytes used to store a value in [0, max_val].
+    static int cell_bytes(int max_val);
+
+    // Read only the header of a sketching file. Files without the magic
+    // string are in the original format (version 1) where the first three
+    // values are num_sketches(size_t), sketch_len(int), and max_val(int),
+    // followed by the column-major matrix of ints. Return the offset of the
+    // payload.
+    static size_t read_header(const std::string& sketch_file, sss_header& header);
+
+    // Load a binary file with an sketching matrix written by write_all.
+    static Eigen::MatrixXi load_all(sss_header& header,
 				    const std::string& sketch_file);
+
+    // Exit with an error if sketchings with header1 and header2 cannot be
+    // compared, i.e., they have different dimensions or are computed from
+    // different subsequences. Warn if they have different max values.
+    static void check_compatible(const sss_header& header1,
+				 const std::string& sketch_file1,
+				 const sss_header& header2,
+				 const std::string& sketch_file2);
     
     // Write a single sketching array to file in binary format
     static void write(const int* sketch, int size, int max_val, std::ofstream& fout);
@@ -47,8 +118,9 @@ public:
 				  int sketch_dim,
 				  const std::string& dist_file);
 
-    static void pairwise_cos_dist(const Eigen::MatrixXi& sketch1,
-				  const Eigen::MatrixXi& sketch2_tran,
+    // The rows of sketch1 and sketch2 are normalized in place.
+    static void pairwise_cos_dist(Eigen::MatrixXd& sketch1,
+				  Eigen::MatrixXd& sketch2,
 				  const std::string& dist_file);
 
     // Free each int array in sketches.
@@ -57,6 +129,12 @@ public:
     // Load a distance matrix saved by save_dist_matrix and output
     // to std::cout or to npy format
     static void load_dist_matrix(const std::string& dist_file, bool to_stdout);
+
+    // Magic string, version and header of an npy file for an array of
+    // type descr (e.g., <f8) with shape (a python tuple), padded with
+    // spaces; the data follows right after it.
+    static std::string npy_header(const std::string& descr, bool fortran_order,
+				  const std::string& shape);
     
 private:
     static void save_dist_matrix(const Eigen::MatrixXd& dist,
@@ -0,0 +1,114 @@
+/*
+  Part of SubseqSketch.
+  Read-only memory mapped view of a binary sketching file.
+  By Ke @ Penn State
+*/
+
+#include "sss_mapped.hpp"
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+sss_mapped::sss_mapped(const std::string& sketch_file, access hint)
+    : file(sketch_file), file_data(nullptr), file_size(0), mapped(false),
+      payload(nullptr), payload_size(0), sq_norms(nullptr)
+{
+    size_t offset = sss_array::read_header(sketch_file, hdr);
+
+    int fd = open(sketch_file.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+	// throw std::runtime_error("Could not open the file: " + sketch_file);
+	std::cerr << "Error: could not open the file: "
+		  << sketch_file << std::endl;
+	std::exit(1);
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+	void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(p != MAP_FAILED)
+	{
+	    file_data = static_cast<const char*>(p);
+	    file_size = st.st_size;
+	    mapped = true;
+	}
+    }
+    close(fd);
+
+    if(!mapped)
+    {
+	// not a regular file or cannot be mapped, read all at once
+	std::ifstream fin(sketch_file, std::ios::binary);
+	buffer.assign(std::istreambuf_iterator<char>(fin),
+		      std::istreambuf_iterator<char>());
+	file_data = buffer.data();
+	file_size = buffer.size();
+    }
+
+    payload_size = hdr.num_sketches * hdr.sketch_len * hdr.cell_bytes;
+    if(offset > file_size || file_size - offset < payload_size)
+    {
+	std::cerr << "Error: the sketching file is truncated: "
+		  << sketch_file << std::endl;
+	std::exit(1);
+    }
+    payload = file_data + offset;
+
+    if(hdr.flags & SSS_HAS_NORMS)
+    {
+	size_t norms = sss_array::norms_offset(hdr, offset);
+	if(norms > file_size || (file_size - norms) / sizeof(uint64_t) < hdr.num_sketches)
+	{
+	    std::cerr << "Error: the norms in the sketching file are truncated: "
+		      << sketch_file << std::endl;
+	    std::exit(1);
+	}
+	sq_norms = reinterpret_cast<const uint64_t*>(file_data + norms);
+    }
+
+    advise(hint);
+}
+
+sss_mapped::~sss_mapped()
+{
+    if(mapped)
+    {
+	munmap(const_cast<char*>(file_data), file_size);
+    }
+}
+
+void sss_mapped::advise(access hint) const
+{
+    if(!mapped) return;
+
+    int advice = MADV_NORMAL;
+    switch(hint)
+    {
+    case SEQUENTIAL: advice = MADV_SEQUENTIAL; break;
+    case RANDOM: advice = MADV_RANDOM; break;
+    case WILLNEED: advice = MADV_WILLNEED; break;
+    }
+    madvise(const_cast<char*>(file_data), file_size, advice);
+}
+
+void sss_mapped::check_cells(std::size_t cell_size, int layout) const
+{
+    if(cell_size != hdr.cell_bytes || layout != hdr.layout)
+    {
+	std::cerr << "Error: " << file << " stores " << int(hdr.cell_bytes)
+		  << "-byte values in "
+		  << (hdr.layout == SSS_ROW_MAJOR ? "row" : "column")
+		  << "-major order, cannot be viewed as " << cell_size
+		  << "-byte values in "
+		  << (layout == SSS_ROW_MAJOR ? "row" : "column")
+		  << "-major order" << std::endl;
+	std::exit(1);
+    }
+}
@@ -0,0 +1,159 @@
+/*
+  Part of SubseqSketch.
+  Read-only memory mapped view of a binary sketching file.
+  By Ke @ Penn State
+*/
+
+#ifndef __SSS_MAPPED_H__
+#define __SSS_MAPPED_H__
+
+#include "sss_array.hpp"
+#include <string>
+#include <vector>
+#include <cmath>
+#include <Eigen/Dense>
+
+// Map the payload of a sketching file into memory instead of reading it,
+// the values are paged in by the OS on demand and the pages are shared by
+// all processes mapping the same file. If the file cannot be mapped it is
+// read into memory. Files in the original format can also be mapped.
+class sss_mapped
+{
+public:
+    // Access pattern hints passed to madvise.
+    enum access { SEQUENTIAL, RANDOM, WILLNEED };
+
+    template<typename T>
+    using row_major_map = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> >;
+    template<typename T>
+    using col_major_map = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> >;
+
+    explicit sss_mapped(const std::string& sketch_file, access hint = SEQUENTIAL);
+    ~sss_mapped();
+
+    sss_mapped(const sss_mapped&) = delete;
+    sss_mapped& operator=(const sss_mapped&) = delete;
+
+    const sss_header& header() const { return hdr; }
+    std::size_t rows() const { return hdr.num_sketches; }
+    std::size_t cols() const { return hdr.sketch_len; }
+
+    // The squared norms of the rows stored in the file, or null if the
+    // file has no norms.
+    const uint64_t* squared_norms() const { return sq_norms; }
+
+    // Change the access pattern hint of the whole payload.
+    void advise(access hint) const;
+
+    // The payload as a num_sketches x sketch_len matrix without copying.
+    // T must match the cell size and the layout must match the file, i.e.,
+    // row_major for version 3 files, col_major for version 1 files.
+    template<typename T>
+    row_major_map<T> row_major() const;
+    template<typename T>
+    col_major_map<T> col_major() const;
+
+    // Copy rows [first, first + n) to a matrix of type S.
+    template<typename S>
+    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic> block(std::size_t first, std::size_t n) const;
+
+    // Copy all rows to a matrix of type S.
+    template<typename S>
+    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic> all() const
+    {
+	return block<S>(0, rows());
+    }
+
+    // Copy rows [first, first + n) to a matrix of type S, each divided by
+    // its norm. The norms stored in the file are used if there are any,
+    // rows of zeros are left unchanged.
+    template<typename S>
+    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic> normalized_block(std::size_t first, std::size_t n) const;
+
+private:
+    std::string file;
+    sss_header hdr;
+
+    // Whole file content, either mapped or read into buffer.
+    const char* file_data;
+    std::size_t file_size;
+    bool mapped;
+    std::vector<char> buffer;
+
+    const char* payload;
+    std::size_t payload_size;
+    const uint64_t* sq_norms;
+
+    void check_cells(std::size_t cell_size, int layout) const;
+
+    template<typename T, typename S>
+    void copy_block(std::size_t first, std::size_t n,
+		    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic>& out) const;
+};
+
+
+template<typename T>
+sss_mapped::row_major_map<T> sss_mapped::row_major() const
+{
+    check_cells(sizeof(T), SSS_ROW_MAJOR);
+    return row_major_map<T>(reinterpret_cast<const T*>(payload), rows(), cols());
+}
+
+template<typename T>
+sss_mapped::col_major_map<T> sss_mapped::col_major() const
+{
+    check_cells(sizeof(T), SSS_COL_MAJOR);
+    return col_major_map<T>(reinterpret_cast<const T*>(payload), rows(), cols());
+}
+
+template<typename T, typename S>
+void sss_mapped::copy_block(std::size_t first, std::size_t n,
+			    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic>& out) const
+{
+    if(hdr.layout == SSS_ROW_MAJOR)
+    {
+	out = row_major<T>().middleRows(first, n).template cast<S>();
+    }
+    else
+    {
+	out = col_major<T>().middleRows(first, n).template cast<S>();
+    }
+}
+
+template<typename S>
+Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic> sss_mapped::block(std::size_t first, std::size_t n) const
+{
+    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic> out;
+    switch(hdr.cell_bytes)
+    {
+    case 1: copy_block<uint8_t>(first, n, out); break;
+    case 2: copy_block<uint16_t>(first, n, out); break;
+    default: copy_block<int32_t>(first, n, out); break;
+    }
+    return out;
+}
+
+template<typename S>
+Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic> sss_mapped::normalized_block(std::size_t first, std::size_t n) const
+{
+    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic> out = block<S>(first, n);
+    // the norms are in double precision for any S
+    Eigen::VectorXd norms(n);
+    if(sq_norms)
+    {
+	for(std::size_t i = 0; i < n; ++i)
+	{
+	    norms[i] = std::sqrt(double(sq_norms[first + i]));
+	}
+    }
+    else
+    {
+	norms = out.template cast<double>().rowwise().norm();
+    }
+    norms = (norms.array() > 0).select(norms, 1.0);
+    out.array().colwise() /= norms.cast<S>().array();
+
+    return out;
+}
+
+#endif
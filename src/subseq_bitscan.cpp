@@ -0,0 +1,155 @@
+/*
+  Part of SubseqSketch.
+  Bit-parallel sketching with single-character tokens.
+  By Ke @ Penn State
+*/
+
+#include "subseq_bitscan.hpp"
+#include <algorithm>
+
+namespace
+{
+const int block_subs = subseq_bitscan::lanes * 64;
+
+// Characters of the sequence tokenized at a time.
+const std::size_t chunk_len = 4096;
+
+bool any(const uint64_t* words)
+{
+    uint64_t x = 0;
+    for(int w = 0; w < subseq_bitscan::lanes; ++w)
+    {
+	x |= words[w];
+    }
+    return x != 0;
+}
+
+// for_each_token on the characters [from, from + len) of seq, tokens are
+// single characters so none is lost at the ends.
+template<typename F>
+void tokens_in(const subsequences& subs, const std::string& seq,
+	       std::size_t from, std::size_t len, F f)
+{
+    subs.for_each_token(seq.data() + from, len, f);
+}
+
+template<typename F>
+void tokens_in(const subsequences& subs, const packed_sequence& seq,
+	       std::size_t from, std::size_t len, F f)
+{
+    subs.for_each_token(seq, from, from + len, f);
+}
+}
+
+bool subseq_bitscan::applicable(const subsequences& subs)
+{
+    return subs.token_len == 1 && subs.num_distinct_tokens < 256;
+}
+
+subseq_bitscan::subseq_bitscan(const subsequences& subs)
+    : subs(subs), num_tokens(subs.num_tokens),
+      num_ids(subs.num_distinct_tokens),
+      num_blocks((subs.size() + block_subs - 1) / block_subs),
+      masks(std::size_t(num_blocks) * num_ids * num_tokens * lanes, 0)
+{
+    const std::vector<int>& tokens = subs.token_ids;
+    for(std::size_t j = 0; j < subs.size(); ++j)
+    {
+	std::size_t b = j / block_subs;
+	int w = (j % block_subs) / 64;
+	uint64_t bit = uint64_t(1) << (j % 64);
+	for(int k = 0; k < num_tokens; ++k)
+	{
+	    int id = tokens[j * num_tokens + k];
+	    masks[((b * num_ids + id) * num_tokens + k) * lanes + w] |= bit;
+	}
+    }
+}
+
+void subseq_bitscan::sketch(const std::string& seq, int first, int last, int* out,
+			    workspace& ws) const
+{
+    scan(seq, first, last, out, ws);
+}
+
+void subseq_bitscan::sketch(const packed_sequence& seq, int first, int last, int* out,
+			    workspace& ws) const
+{
+    scan(seq, first, last, out, ws);
+}
+
+template<typename Seq>
+void subseq_bitscan::scan(const Seq& seq, int first, int last, int* out,
+			  workspace& ws) const
+{
+    std::vector<uint8_t>& ids = ws.ids;
+    std::vector<uint64_t>& level = ws.level;
+    level.resize((num_tokens + 1) * lanes);
+
+    // the sequence is tokenized in chunks as far as the blocks need it,
+    // most subsequences are fully matched long before its end
+    ids.clear();
+    std::size_t tokenized = 0;
+    auto more_ids = [&]()
+    {
+	std::size_t len = std::min(chunk_len, seq.size() - tokenized);
+	tokens_in(subs, seq, tokenized, len, [&](size_t, int id)
+	{
+	    ids.push_back(id);
+	    return true;
+	});
+	tokenized += len;
+    };
+
+    for(int b = first / block_subs; b * block_subs < last; ++b)
+    {
+	// only the subsequences in [first, last) of this block take part
+	int lo_sub = std::max(first, b * block_subs);
+	int hi_sub = std::min(last, (b + 1) * block_subs);
+	std::fill(level.begin(), level.end(), 0);
+	for(int j = lo_sub; j < hi_sub; ++j)
+	{
+	    int s = j - b * block_subs;
+	    level[s / 64] |= uint64_t(1) << (s % 64);
+	}
+
+	// lowest and highest occupied levels below num_tokens
+	int lo = 0, hi = 0;
+	const uint64_t* block_masks = masks.data() + std::size_t(b) * num_ids * num_tokens * lanes;
+	for(std::size_t i = 0; lo < num_tokens; ++i)
+	{
+	    while(i == ids.size() && tokenized < seq.size()) more_ids();
+	    if(i == ids.size()) break;
+
+	    const uint64_t* m = block_masks + std::size_t(ids[i]) * num_tokens * lanes;
+	    // top down, so that one character advances a subsequence once
+	    for(int k = hi; k >= lo; --k)
+	    {
+		uint64_t* cur = level.data() + k * lanes;
+		const uint64_t* mk = m + k * lanes;
+		for(int w = 0; w < lanes; ++w)
+		{
+		    uint64_t moved = cur[w] & mk[w];
+		    cur[w] ^= moved;
+		    cur[w + lanes] |= moved;
+		}
+	    }
+
+	    if(hi + 1 < num_tokens && any(level.data() + (hi + 1) * lanes)) ++hi;
+	    while(lo < num_tokens && !any(level.data() + lo * lanes)) ++lo;
+	    if(lo > hi) hi = lo;
+	}
+
+	for(int k = 0; k <= num_tokens; ++k)
+	{
+	    for(int w = 0; w < lanes; ++w)
+	    {
+		for(uint64_t bits = level[k * lanes + w]; bits != 0; bits &= bits - 1)
+		{
+		    int j = b * block_subs + w * 64 + __builtin_ctzll(bits);
+		    out[j - first] = k;
+		}
+	    }
+	}
+    }
+}
@@ -0,0 +1,71 @@
+/*
+  Part of SubseqSketch.
+  Bit-parallel sketching with single-character tokens.
+  By Ke @ Penn State
+*/
+
+#ifndef __SUBSEQ_BITSCAN_H__
+#define __SUBSEQ_BITSCAN_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "subsequences.hpp"
+
+// With tokens of one character, the subsequences are processed in blocks
+// of lanes * 64 with one bit per subsequence: level[k] holds the
+// subsequences whose first k tokens are matched, and mask[c][k] the ones
+// whose (k + 1)-th token is c. A character c of the sequence moves
+// level[k] & mask[c][k] up to level k + 1 for all k at once, much like
+// Shift-And but for greedy subsequence matching. Only the levels between
+// the lowest and the highest occupied one are updated, and the scan of a
+// block stops once all its subsequences are fully matched.
+//
+// The lanes words of a level are updated by the same loop, which the
+// compiler vectorizes (256 subsequences per SIMD operation with AVX2).
+// The masks are built once and only read while sketching, so one
+// bitscan is shared by all threads, each with its own workspace.
+class subseq_bitscan
+{
+public:
+    static const int lanes = 4;
+
+    // State of one sketching thread, reused between calls.
+    struct workspace
+    {
+	// Token ids of the current sequence, positions without a token of
+	// the subsequences are dropped.
+	std::vector<uint8_t> ids;
+	// level[k * lanes + w], k in [0, num_tokens].
+	std::vector<uint64_t> level;
+    };
+
+    // Whether the subsequences can be sketched by this kernel: single
+    // character tokens, at most 255 distinct ones.
+    static bool applicable(const subsequences& subs);
+
+    subseq_bitscan(const subsequences& subs);
+
+    // Same as subseq_scanner::sketch, with the state kept in ws.
+    void sketch(const std::string& seq, int first, int last, int* out,
+		workspace& ws) const;
+    void sketch(const packed_sequence& seq, int first, int last, int* out,
+		workspace& ws) const;
+
+    // Bytes held by the masks.
+    std::size_t memory() const { return masks.size() * sizeof(uint64_t); }
+
+private:
+    const subsequences& subs;
+    int num_tokens;
+    int num_ids;
+    int num_blocks;
+    // masks[((b * num_ids + id) * num_tokens + k) * lanes + w]: word w of
+    // the subsequences of block b whose k-th token is id.
+    std::vector<uint64_t> masks;
+
+    template<typename Seq>
+    void scan(const Seq& seq, int first, int last, int* out, workspace& ws) const;
+};
+
+#endif
@@ -0,0 +1,70 @@
+/*
+  Part of SubseqSketch.
+  Single-pass sketching of a sequence against a list of subsequences.
+  By Ke @ Penn State
+*/
+
+#include "subseq_scanner.hpp"
+
+subseq_scanner::subseq_scanner(const subsequences& subs)
+    : subs(subs), num_tokens(subs.num_tokens),
+      buckets(subs.num_distinct_tokens)
+{}
+
+void subseq_scanner::sketch(const std::string& seq, int first, int last, int* out)
+{
+    scan(seq, first, last, out);
+}
+
+void subseq_scanner::sketch(const packed_sequence& seq, int first, int last, int* out)
+{
+    scan(seq, first, last, out);
+}
+
+template<typename Seq>
+void subseq_scanner::scan(const Seq& seq, int first, int last, int* out)
+{
+    const std::vector<int>& tokens = subs.token_ids;
+
+    int active = last - first;
+    for(int j = first; j < last; ++j)
+    {
+	out[j - first] = 0;
+	buckets[tokens[j * num_tokens]].push_back(j);
+    }
+
+    subs.for_each_token(seq, [&](size_t, int id)
+    {
+	std::vector<int>& waiting = buckets[id];
+	for(int j : waiting)
+	{
+	    if(++out[j - first] < num_tokens)
+	    {
+		advanced.push_back(j);
+	    }
+	    else
+	    {
+		--active;
+	    }
+	}
+	waiting.clear();
+
+	for(int j : advanced)
+	{
+	    buckets[tokens[j * num_tokens + out[j - first]]].push_back(j);
+	}
+	advanced.clear();
+
+	return active > 0;
+    });
+
+    // leave the buckets empty for the next call
+    for(int j = first; j < last && active > 0; ++j)
+    {
+	if(out[j - first] < num_tokens)
+	{
+	    buckets[tokens[j * num_tokens + out[j - first]]].clear();
+	    --active;
+	}
+    }
+}
@@ -0,0 +1,46 @@
+/*
+  Part of SubseqSketch.
+  Single-pass sketching of a sequence against a list of subsequences.
+  By Ke @ Penn State
+*/
+
+#ifndef __SUBSEQ_SCANNER_H__
+#define __SUBSEQ_SCANNER_H__
+
+#include <string>
+#include <vector>
+#include "subsequences.hpp"
+
+// Instead of searching each subsequence in the sequence separately, the
+// scanner walks through the sequence once. Every subsequence keeps a cursor
+// to its next unmatched token and waits in the bucket of that token. The
+// token at each position of the sequence advances all subsequences waiting
+// in its bucket, so the total work is O(|seq| + num_subseqs * num_tokens).
+// A scanner keeps its buckets between calls and is not thread-safe, use one
+// scanner per thread.
+class subseq_scanner
+{
+public:
+    subseq_scanner(const subsequences& subs);
+
+    // For each j in [first, last), compute the maximum number of consecutive
+    // tokens (starting from the leftmost one) in subs.seqs[j] that form a
+    // subsequence (of tokens) of seq, the result is stored in out[j - first].
+    void sketch(const std::string& seq, int first, int last, int* out);
+    void sketch(const packed_sequence& seq, int first, int last, int* out);
+
+private:
+    const subsequences& subs;
+    int num_tokens;
+    // For each token id, the subsequences waiting for that token.
+    std::vector<std::vector<int> > buckets;
+    // Subsequences advanced at the current position, they are put into the
+    // buckets of their next tokens after the position is processed so that
+    // the next token is searched strictly after the current position.
+    std::vector<int> advanced;
+
+    template<typename Seq>
+    void scan(const Seq& seq, int first, int last, int* out);
+};
+
+#endif
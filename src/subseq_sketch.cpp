@@ -7,11 +7,30 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
 
 #include "fasta_reader.hpp"
 #include "subsequences.hpp"
-// #include "tokenized_sequence.hpp"
+#include "subseq_scanner.hpp"
+#include "subseq_bitscan.hpp"
+#include "tokenized_sequence.hpp"
 #include "sss_array.hpp"
+#include "sss_mapped.hpp"
+#include "tiled_dist.hpp"
+#include "int_gemm.hpp"
+#include "sparse_dist.hpp"
+#include "hnsw_index.hpp"
+#include "lsh_dist.hpp"
+#include "nj_tree.hpp"
+#include "sketch_clusters.hpp"
+#include "bounded_queue.hpp"
 #include "CLI11.hpp"
 
 #include <omp.h>
@@ -25,11 +44,55 @@ void gen_random_subsequences(const int subseq_len,
 			     const std::string& subseq_file);
 
 void compute_sketchings(const std::string& subseq_file,
-			const std::vector<std::string>& input_files);
+			const std::vector<std::string>& input_files,
+			const std::string& engine,
+			size_t max_memory,
+			bool packed);
 
 void compute_distances(const std::string& sketch_file1,
 		       const std::string& sketch_file2,
-		       const std::string& dist_file);
+		       const std::string& dist_file,
+		       size_t tile, size_t max_memory, double max_dist,
+		       tiled_dist::precision prec);
+
+void compute_self_distances(const std::string& sketch_file,
+			    const std::string& dist_file,
+			    bool condensed, size_t tile, size_t max_memory,
+			    double max_dist, tiled_dist::precision prec);
+
+void save_sparse_distances(const tiled_dist& dist, double max_dist,
+			   const std::string& dist_file);
+
+void lsh_distances(const std::string& sketch_file1,
+		   const std::string& sketch_file2,
+		   const std::string& dist_file,
+		   size_t bands, size_t band_rows, size_t max_bucket,
+		   double max_dist);
+
+void find_neighbors(const std::string& query_file,
+		    const std::string& ref_file,
+		    const std::string& knn_file,
+		    size_t k, size_t tile, tiled_dist::precision prec);
+
+void build_tree(const std::string& sketch_file,
+		const std::string& dist_file,
+		const std::string& labels_file,
+		const std::string& tree_file,
+		size_t tile, size_t max_memory);
+
+void cluster_sketchings(const std::string& sketch_file,
+			const std::string& cluster_file,
+			double max_dist, size_t k, size_t max_iter, uint64_t seed,
+			size_t tile, size_t max_memory);
+
+void build_index(const std::vector<std::string>& sketch_files,
+		 const std::string& index_file,
+		 size_t M, size_t ef_construction, uint64_t seed);
+
+void query_index(const std::string& index_file,
+		 const std::string& query_file,
+		 const std::string& knn_file,
+		 size_t k, size_t ef);
 
 void show_sketchings(const std::string& sketch_file);
 
@@ -44,6 +107,14 @@ int main(int argc, char** argv)
     app.require_subcommand(1);
     app.get_formatter()->column_width(20);
 
+    std::map<std::string, int_gemm::kernel> kernels =
+	{{"auto", int_gemm::AUTO}, {"scalar", int_gemm::SCALAR}, {"sse2", int_gemm::SSE2},
+	 {"avx2", int_gemm::AVX2}, {"avx512", int_gemm::AVX512}, {"neon", int_gemm::NEON}};
+    int_gemm::kernel kernel;
+    app.add_option("--kernel", kernel, "Instruction set of the integer dot product kernels (--precision int): auto, scalar, sse2, avx2, avx512 or neon")
+	->transform(CLI::CheckedTransformer(kernels))
+	->default_val("auto");
+
     // *****************
     // init subcommand
     // *****************
@@ -66,7 +137,7 @@ int main(int argc, char** argv)
 	->default_val("alphabets/DNA");
     
     std::vector<std::string> input_files;
-    init->add_option("-i,--input", input_files, "Fasta file(s) to randomly sample subsequences from")
+    init->add_option("-i,--input", input_files, "Fasta/fastq file(s) to randomly sample subsequences from")
 	->check(CLI::ExistingFile);
 
     std::string subseq_file;
@@ -83,10 +154,23 @@ int main(int argc, char** argv)
 	->required()
 	->check(CLI::ExistingFile);
 
-    sketch->add_option("-i,--input,fasta_files", input_files, "Fasta file(s) containing sequences to sketch")
+    sketch->add_option("-i,--input,fasta_files", input_files, "Fasta/fastq file(s) containing sequences to sketch")
 	->required()
 	->check(CLI::ExistingFile);
 
+    std::string engine;
+    sketch->add_option("-e,--engine", engine, "Sketching engine: scan (one pass over each sequence for all subsequences) or index (index token positions of each sequence, better for long sequences)")
+	->default_val("scan")
+	->check(CLI::IsMember({"scan", "index"}));
+
+    size_t max_memory;
+    sketch->add_option("-m,--max-memory", max_memory, "Approximate memory budget (in MB) for the sequences and sketchings being processed")
+	->default_val(1024)
+	->check(CLI::PositiveNumber);
+
+    bool packed = false;
+    sketch->add_flag("--packed", packed, "Hold the sequences with 2 bits per character, for subsequences over at most 4 characters (e.g., DNA or RNA) with tokens of at most 32 characters");
+
     
     // *****************
     // dist subcommand
@@ -99,14 +183,222 @@ int main(int argc, char** argv)
 	->check(CLI::ExistingFile);
 
     std::string sketch_file2;
-    dist->add_option("-b,--input2,sketch_file2", sketch_file2, "Second file of sketchings")
-	->required()
+    CLI::Option* input2 = dist->add_option("-b,--input2,sketch_file2", sketch_file2, "Second file of sketchings")
 	->check(CLI::ExistingFile);
 
+    bool self_dist = false;
+    CLI::Option* self_opt = dist->add_flag("--self", self_dist, "Compute the distances among the sketchings of the first file only, the symmetric matrix is computed once for each pair")
+	->excludes(input2);
+    input2->excludes(self_opt);
+
+    bool condensed = false;
+    CLI::Option* condensed_opt = dist->add_flag("--condensed", condensed, "With --self, write only the upper triangle as a 1-d npy array in the order of scipy pdist")
+	->needs(self_opt);
+
+    double max_dist;
+    dist->add_option("--max-dist", max_dist, "Only keep the distances not larger than this and write them as a sparse matrix (with --self only the pairs i < j)")
+	->check(CLI::Range(0.0, 2.0))
+	->excludes(condensed_opt);
+
+    std::map<std::string, tiled_dist::precision> precisions =
+	{{"double", tiled_dist::DOUBLE}, {"float", tiled_dist::FLOAT}, {"int", tiled_dist::INT}};
+    tiled_dist::precision precision;
+    dist->add_option("--precision", precision, "Arithmetic of the dot products: double, float (faster, about 7 significant digits) or int (exact integer dot products, normalized at the end)")
+	->transform(CLI::CheckedTransformer(precisions))
+	->default_val("double");
+
     std::string dist_file;
     dist->add_option("-o,--output", dist_file, "File for storing the sketching distances")
 	->default_val("dist.sss-dist");
 
+    size_t tile;
+    dist->add_option("--tile", tile, "Compute and write the distances in tiles of this many sketchings per side (0: only if the distance matrix does not fit in the memory budget)")
+	->default_val(0);
+
+    size_t dist_max_memory;
+    dist->add_option("-m,--max-memory", dist_max_memory, "Approximate memory budget (in MB) for the distances being computed")
+	->default_val(1024)
+	->check(CLI::PositiveNumber);
+
+    std::vector<size_t> lsh_params;
+    CLI::Option* lsh_opt = dist->add_option("--lsh", lsh_params, "Only compare the pairs sharing a band of random hyperplane signatures, given as bands,rows (up to 64 rows), and write them as a sparse matrix")
+	->expected(2)
+	->delimiter(',')
+	->excludes(condensed_opt);
+
+    size_t lsh_max_bucket;
+    dist->add_option("--lsh-max-bucket", lsh_max_bucket, "Pair each sketching with at most this many others sharing its signature in a band (0: all of them), which bounds the comparisons of many near-identical sketchings but misses some of their pairs")
+	->default_val(0)
+	->needs(lsh_opt);
+
+
+    // *****************
+    // knn subcommand
+    // *****************
+    CLI::App* knn = app.add_subcommand("knn", "Find the nearest reference sketchings of each query sketching");
+
+    std::string query_file;
+    knn->add_option("-q,--query,query_file", query_file, "File of query sketchings")
+	->required()
+	->check(CLI::ExistingFile);
+
+    std::string ref_file;
+    knn->add_option("-r,--reference,ref_file", ref_file, "File of reference sketchings")
+	->required()
+	->check(CLI::ExistingFile);
+
+    size_t num_neighbors;
+    knn->add_option("-k,--neighbors", num_neighbors, "Number of nearest references to report for each query")
+	->default_val(10)
+	->check(CLI::PositiveNumber);
+
+    std::string knn_file;
+    knn->add_option("-o,--output", knn_file, "Tab separated file of query index, reference index and distance")
+	->default_val("knn.tsv");
+
+    size_t knn_tile;
+    knn->add_option("--tile", knn_tile, "Number of sketchings per side of the blocks of distances computed at a time")
+	->default_val(1024)
+	->check(CLI::PositiveNumber);
+
+    knn->add_option("--precision", precision, "Arithmetic of the dot products: double, float or int")
+	->transform(CLI::CheckedTransformer(precisions))
+	->default_val("double");
+
+
+    // *****************
+    // tree subcommand
+    // *****************
+    CLI::App* tree = app.add_subcommand("tree", "Build a neighbor-joining tree of the sketchings of one file");
+
+    std::string tree_sketch_file;
+    CLI::Option* tree_input = tree->add_option("-i,--input,sketch_file", tree_sketch_file, "File of sketchings, the distances are computed in memory")
+	->check(CLI::ExistingFile);
+
+    std::string tree_dist_file;
+    CLI::Option* tree_dist = tree->add_option("-d,--dist", tree_dist_file, "Square distance matrix computed by dist, instead of a sketching file")
+	->check(CLI::ExistingFile)
+	->excludes(tree_input);
+    tree_input->excludes(tree_dist);
+
+    std::string labels_file;
+    tree->add_option("-l,--labels", labels_file, "File of leaf names, one per line in the order of the sketchings (default: 0-based indices)")
+	->check(CLI::ExistingFile);
+
+    std::string tree_file;
+    tree->add_option("-o,--output", tree_file, "Output tree file in Newick format")
+	->default_val("tree.nwk");
+
+    size_t tree_tile;
+    tree->add_option("--tile", tree_tile, "Compute the distances in tiles of this many sketchings per side (0: from the memory budget)")
+	->default_val(0);
+
+    size_t tree_max_memory;
+    tree->add_option("-m,--max-memory", tree_max_memory, "Approximate memory budget (in MB) for the tiles of distances being computed")
+	->default_val(1024)
+	->check(CLI::PositiveNumber);
+
+
+    // *****************
+    // cluster subcommand
+    // *****************
+    CLI::App* cluster = app.add_subcommand("cluster", "Cluster the sketchings of one file by single-linkage or k-medoids");
+
+    std::string cluster_sketch_file;
+    cluster->add_option("-i,--input,sketch_file", cluster_sketch_file, "File of sketchings")
+	->required()
+	->check(CLI::ExistingFile);
+
+    std::string cluster_file;
+    cluster->add_option("-o,--output", cluster_file, "Tab separated file of sketching index and cluster (smallest member or medoid index)")
+	->default_val("clusters.tsv");
+
+    double link_dist;
+    CLI::Option* link_opt = cluster->add_option("--max-dist", link_dist, "Single-linkage: link the sketchings within this distance and report the connected components")
+	->check(CLI::Range(0.0, 2.0));
+
+    size_t num_medoids;
+    CLI::Option* medoids_opt = cluster->add_option("-k,--medoids", num_medoids, "k-medoids: number of clusters, seeded by k-means++")
+	->check(CLI::PositiveNumber)
+	->excludes(link_opt);
+    link_opt->excludes(medoids_opt);
+
+    size_t max_iter;
+    cluster->add_option("--max-iter", max_iter, "Maximum number of k-medoids iterations")
+	->default_val(100)
+	->check(CLI::PositiveNumber)
+	->needs(medoids_opt);
+
+    uint64_t cluster_seed;
+    cluster->add_option("--seed", cluster_seed, "Seed of the k-means++ seeding")
+	->default_val(1)
+	->needs(medoids_opt);
+
+    size_t cluster_tile;
+    cluster->add_option("--tile", cluster_tile, "Single-linkage: compute the distances in tiles of this many sketchings per side (0: from the memory budget)")
+	->default_val(0);
+
+    size_t cluster_max_memory;
+    cluster->add_option("-m,--max-memory", cluster_max_memory, "Approximate memory budget (in MB) for the tiles of distances being computed")
+	->default_val(1024)
+	->check(CLI::PositiveNumber);
+
+
+    // *****************
+    // index subcommand
+    // *****************
+    CLI::App* index = app.add_subcommand("index", "Build or query an approximate nearest neighbor index of sketchings");
+    index->require_subcommand(1);
+
+    CLI::App* index_build = index->add_subcommand("build", "Build an HNSW index of one or more sketching files");
+
+    std::vector<std::string> index_inputs;
+    index_build->add_option("-i,--input,sketch_files", index_inputs, "Sketch files to be indexed, ids follow the order of the files")
+	->required()
+	->check(CLI::ExistingFile);
+
+    std::string index_file;
+    index_build->add_option("-o,--output", index_file, "Output index file")
+	->default_val("sketches.sss-index");
+
+    size_t index_M;
+    index_build->add_option("-M,--max-links", index_M, "Number of neighbors of each node (twice as many at the bottom layer)")
+	->default_val(16)
+	->check(CLI::Range(2, 1024));
+
+    size_t ef_construction;
+    index_build->add_option("--ef-construction", ef_construction, "Number of candidates searched when inserting a node")
+	->default_val(200)
+	->check(CLI::PositiveNumber);
+
+    uint64_t index_seed;
+    index_build->add_option("--seed", index_seed, "Seed of the random levels of the nodes")
+	->default_val(1);
+
+    CLI::App* index_query = index->add_subcommand("query", "Find the approximate nearest indexed sketchings of each query sketching");
+
+    index_query->add_option("-x,--index", index_file, "Index file built by index build")
+	->required()
+	->check(CLI::ExistingFile);
+
+    index_query->add_option("-q,--query,query_file", query_file, "File of query sketchings")
+	->required()
+	->check(CLI::ExistingFile);
+
+    size_t index_k;
+    index_query->add_option("-k,--neighbors", index_k, "Number of nearest sketchings to report for each query")
+	->default_val(10)
+	->check(CLI::PositiveNumber);
+
+    size_t ef_search;
+    index_query->add_option("--ef", ef_search, "Number of candidates searched for each query, larger is more accurate")
+	->default_val(64)
+	->check(CLI::PositiveNumber);
+
+    std::string index_knn_file;
+    index_query->add_option("-o,--output", index_knn_file, "Tab separated file of query index, sketching id and distance")
+	->default_val("query.tsv");
+
 
     // *****************
     // merge subcommand
@@ -147,6 +439,18 @@ int main(int argc, char** argv)
 
     CLI11_PARSE(app, argc, argv);
 
+    if(!int_gemm::select(kernel))
+    {
+	std::cerr << "Error: the " << int_gemm::name(kernel)
+		  << " kernel is not available on this host" << std::endl;
+	std::exit(1);
+    }
+    if((app.got_subcommand(dist) || app.got_subcommand(knn)) && precision == tiled_dist::INT)
+    {
+	std::cout << "Integer dot product kernel: "
+		  << int_gemm::name(int_gemm::selected()) << std::endl;
+    }
+
     if(app.got_subcommand(init))
     {
 	gen_random_subsequences(subseq_len, token_len, num_subseqs,
@@ -154,11 +458,73 @@ int main(int argc, char** argv)
     }
     else if(app.got_subcommand(sketch))
     {
-	compute_sketchings(subseq_file, input_files);
+	compute_sketchings(subseq_file, input_files, engine, max_memory, packed);
     }
     else if(app.got_subcommand(dist))
     {
-	compute_distances(sketch_file1, sketch_file2, dist_file);
+	if(!lsh_params.empty())
+	{
+	    if(!self_dist && sketch_file2.empty())
+	    {
+		std::cerr << "Error: --input2 or --self is required" << std::endl;
+		std::exit(1);
+	    }
+	    lsh_distances(sketch_file1, self_dist ? "" : sketch_file2, dist_file,
+			  lsh_params[0], lsh_params[1], lsh_max_bucket,
+			  dist->count("--max-dist") ? max_dist : 2);
+	}
+	else if(self_dist)
+	{
+	    compute_self_distances(sketch_file1, dist_file, condensed, tile, dist_max_memory,
+				   dist->count("--max-dist") ? max_dist : -1, precision);
+	}
+	else if(sketch_file2.empty())
+	{
+	    std::cerr << "Error: --input2 or --self is required" << std::endl;
+	    std::exit(1);
+	}
+	else
+	{
+	    compute_distances(sketch_file1, sketch_file2, dist_file, tile, dist_max_memory,
+			      dist->count("--max-dist") ? max_dist : -1, precision);
+	}
+    }
+    else if(app.got_subcommand(knn))
+    {
+	find_neighbors(query_file, ref_file, knn_file, num_neighbors, knn_tile, precision);
+    }
+    else if(app.got_subcommand(tree))
+    {
+	if(tree_sketch_file.empty() && tree_dist_file.empty())
+	{
+	    std::cerr << "Error: --input or --dist is required" << std::endl;
+	    std::exit(1);
+	}
+	build_tree(tree_sketch_file, tree_dist_file, labels_file, tree_file,
+		   tree_tile, tree_max_memory);
+    }
+    else if(app.got_subcommand(cluster))
+    {
+	if(!cluster->count("--max-dist") && !cluster->count("--medoids"))
+	{
+	    std::cerr << "Error: --max-dist or --medoids is required" << std::endl;
+	    std::exit(1);
+	}
+	cluster_sketchings(cluster_sketch_file, cluster_file,
+			   cluster->count("--max-dist") ? link_dist : -1,
+			   cluster->count("--medoids") ? num_medoids : 0,
+			   max_iter, cluster_seed, cluster_tile, cluster_max_memory);
+    }
+    else if(app.got_subcommand(index))
+    {
+	if(index->got_subcommand(index_build))
+	{
+	    build_index(index_inputs, index_file, index_M, ef_construction, index_seed);
+	}
+	else
+	{
+	    query_index(index_file, query_file, index_knn_file, index_k, ef_search);
+	}
     }
     else if(app.got_subcommand(info))
     {
@@ -248,33 +614,213 @@ void gen_random_subsequences(const int subseq_len,
 	      << subseq_file << std::endl;
 }
 
-// Return the maximum number of consecutive tokens (starting from the
-// leftmost one) in test that form a subsequence (of tokens) of seq
-// using linear search.
-int64_t longest_subsequence(const std::string& seq, const std::string& test,
-			    int token_len)
+// The sketching file being written, under a temporary name until it is
+// complete. If the program exits on an error before that, it is removed
+// so that no partial file is left behind.
+std::string unfinished_sketch_file;
+
+void remove_unfinished_sketch_file()
 {
-    int result = 0;
-    int64_t p = -1;
+    if(!unfinished_sketch_file.empty()) std::remove(unfinished_sketch_file.c_str());
+}
 
-    for(int i = 0; i < test.size(); i += token_len)
+// A batch of consecutive sequences in an input file flowing through the
+// sketching pipeline.
+struct sketch_batch
+{
+    std::vector<std::string> seqs;
+    // Used instead of seqs with --packed.
+    std::vector<packed_sequence> packed;
+    Eigen::MatrixXi sketches;
+};
+
+// A unit of work for the sketching threads: the sequences order[begin, end)
+// against the subsequences [first, last). Long sequences are sketched
+// alone and may be split into several tasks by subsequences, in which case
+// index is the position of their shared index (-1 if not indexed).
+struct sketch_task
+{
+    size_t begin;
+    size_t end;
+    int first;
+    int last;
+    int index;
+};
+
+// Split the sketching of a batch into tasks of similar estimated cost,
+// requires at least one subsequence.
+// Sequences are visited from the longest to the shortest (LPT order), so
+// that the most expensive tasks are started first and the short ones fill
+// the gaps at the end. Short sequences are grouped into one task until the
+// target cost is reached, long ones are split by subsequences.
+template<typename Seq>
+void schedule_tasks(const std::vector<Seq>& seqs,
+		    const std::vector<size_t>& order,
+		    const subsequences& subs,
+		    bool rescan,
+		    std::vector<sketch_task>& tasks,
+		    std::vector<size_t>& indexed)
+{
+    // A sequence is read once and each subsequence is moved through at
+    // most num_tokens tokens. The index engine shares one index among the
+    // tasks of a split sequence, but with the scan engine (rescan) every
+    // task reads the whole sequence again.
+    const int num_subs = subs.size();
+    const size_t subs_cost = static_cast<size_t>(num_subs) * subs.num_tokens;
+    auto cost = [&](size_t i) { return seqs[i].size() + subs_cost; };
+
+    const int num_threads = omp_get_max_threads();
+    const size_t tasks_per_thread = 8;
+    const size_t min_task_cost = 1 << 16;
+
+    size_t total_cost = 0;
+    for(size_t i : order) total_cost += cost(i);
+    size_t target = std::max(min_task_cost, total_cost / (num_threads * tasks_per_thread));
+
+    tasks.clear();
+    indexed.clear();
+    size_t group_begin = 0;
+    size_t group_cost = 0;
+    for(size_t k = 0; k < order.size(); ++k)
     {
-	p = seq.find(test.substr(i, token_len), p + 1);
-	if(p == std::string::npos)
+	size_t c = cost(order[k]);
+	if(c < target)
 	{
-	    break;
+	    group_cost += c;
+	    if(group_cost >= target)
+	    {
+		tasks.push_back({group_begin, k + 1, 0, num_subs, -1});
+		group_begin = k + 1;
+		group_cost = 0;
+	    }
+	    continue;
 	}
-	else
+
+	// order is sorted by length, no short sequences are pending here
+	int num_tiles = std::min<size_t>(num_subs, (c + target - 1) / target);
+	if(rescan)
+	{
+	    // each extra tile costs another pass over the sequence, split only
+	    // as far as the passes do not outweigh the subsequences and there
+	    // are threads to run the tiles
+	    size_t len = std::max<size_t>(1, seqs[order[k]].size());
+	    num_tiles = std::min<size_t>(num_tiles, std::max<size_t>(1, subs_cost / len));
+	    num_tiles = std::min(num_tiles, num_threads);
+	}
+	int tile_size = (num_subs + num_tiles - 1) / num_tiles;
+	int index = -1;
+	if(num_tiles > 1)
+	{
+	    index = indexed.size();
+	    indexed.push_back(order[k]);
+	}
+	for(int first = 0; first < num_subs; first += tile_size)
+	{
+	    tasks.push_back({k, k + 1, first, std::min(first + tile_size, num_subs), index});
+	}
+	group_begin = k + 1;
+    }
+
+    if(group_begin < order.size())
+    {
+	tasks.push_back({group_begin, order.size(), 0, num_subs, -1});
+    }
+}
+
+// Compute the sketchings of all sequences in a batch, Seq is std::string
+// or packed_sequence. bitscan, shared by all threads, is used by the scan
+// engine if not null.
+template<typename Seq>
+void sketch_batch_seqs(const subsequences& subs, const std::string& engine,
+		       const subseq_bitscan* bitscan,
+		       const std::vector<Seq>& seqs, Eigen::MatrixXi& sketches)
+{
+    size_t ct = seqs.size();
+    int num_subs = subs.size();
+    sketches.resize(ct, num_subs);
+    if(num_subs == 0) return;
+
+    std::vector<size_t> order(ct);
+    for(size_t i = 0; i < ct; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+	return seqs[a].size() > seqs[b].size();
+    });
+
+    std::vector<sketch_task> tasks;
+    std::vector<size_t> indexed;
+    schedule_tasks(seqs, order, subs, engine != "index", tasks, indexed);
+    int64_t num_tasks = tasks.size();
+
+    if(engine == "index")
+    {
+	// sequences split into several tasks are indexed first so that
+	// their tasks share one index
+	std::vector<std::unique_ptr<tokenized_sequence> > indexes(indexed.size());
+#pragma omp parallel for schedule(dynamic, 1) default(shared)
+	for(int64_t k = 0; k < static_cast<int64_t>(indexed.size()); ++k)
+	{
+	    indexes[k].reset(new tokenized_sequence(seqs[indexed[k]], subs));
+	}
+
+#pragma omp parallel for schedule(dynamic, 1) default(shared)
+	for(int64_t t = 0; t < num_tasks; ++t)
 	{
-	    result += 1;
+	    const sketch_task& task = tasks[t];
+	    for(size_t k = task.begin; k < task.end; ++k)
+	    {
+		size_t i = order[k];
+		std::unique_ptr<tokenized_sequence> own;
+		const tokenized_sequence* index;
+		if(task.index >= 0)
+		{
+		    index = indexes[task.index].get();
+		}
+		else
+		{
+		    own.reset(new tokenized_sequence(seqs[i], subs));
+		    index = own.get();
+		}
+
+		for(int j = task.first; j < task.last; ++j)
+		{
+		    sketches(i, j) = index->longest_subsequence(j);
+		}
+	    }
 	}
     }
+    else
+    {
+#pragma omp parallel default(shared)
+	{
+	    subseq_scanner scanner(subs);
+	    subseq_bitscan::workspace ws;
+	    std::vector<int> row(num_subs);
 
-    return result;
+#pragma omp for schedule(dynamic, 1)
+	    for(int64_t t = 0; t < num_tasks; ++t)
+	    {
+		const sketch_task& task = tasks[t];
+		for(size_t k = task.begin; k < task.end; ++k)
+		{
+		    size_t i = order[k];
+		    if(bitscan) bitscan->sketch(seqs[i], task.first, task.last, row.data(), ws);
+		    else scanner.sketch(seqs[i], task.first, task.last, row.data());
+		    for(int j = task.first; j < task.last; ++j)
+		    {
+			sketches(i, j) = row[j - task.first];
+		    }
+		}
+	    }
+	}
+    }
 }
 
 void compute_sketchings(const std::string& subseq_file,
-			const std::vector<std::string>& input_files)
+			const std::vector<std::string>& input_files,
+			const std::string& engine,
+			size_t max_memory,
+			bool packed)
 {
     std::cout << "Sketching" << std::endl << "input_files:";
     for(const std::string& s : input_files)
@@ -282,50 +828,140 @@ void compute_sketchings(const std::string& subseq_file,
 	std::cout << " " << s;
     }
     std::cout << std::endl << "subseq_file: " << subseq_file
+	      << std::endl << "engine: " << engine
+	      << std::endl << "max_memory: " << max_memory << "MB"
+	      << std::endl << "packed: " << (packed ? "yes" : "no")
 	      << std::endl << std::endl;
 
     subsequences subs(subseq_file);
     std::cout << "Loaded " << subs.size() << " subsequence(s), num_tokens: "
 	      << subs.num_tokens << " token_len: "
 	      << subs.token_len << std::endl;
+    if(packed && !subs.packable())
+    {
+	std::cerr << "Error: --packed requires subsequences over at most 4 characters"
+		  << " with tokens of at most 32 characters" << std::endl;
+	std::exit(1);
+    }
 
     int num_subs = subs.size();
     std::string ext_name = "n" + std::to_string(num_subs) +
 	".l" + std::to_string(subs.num_tokens) +
 	".t" + std::to_string(subs.token_len) +
 	".sss";
-    
+
+    // single characters are matched bit-parallel by the scan engine, the
+    // masks are built once for all batches and threads
+    std::unique_ptr<subseq_bitscan> bitscan;
+    if(engine == "scan" && subseq_bitscan::applicable(subs))
+    {
+	bitscan.reset(new subseq_bitscan(subs));
+    }
+    size_t shared_memory = bitscan ? bitscan->memory() : 0;
+
+    // The sequences are streamed through three stages connected by bounded
+    // queues: a reader thread parsing sequences into batches, the sketching
+    // threads working on one batch at a time, and a writer thread putting
+    // finished batches into the output file. At most 3 batches of sequences
+    // and 3 batches of sketchings are alive at any time, each batch is
+    // closed when its estimated memory reaches 1/6 of what max_memory
+    // leaves after the shared tables.
+    size_t budget = max_memory << 20;
+    budget -= std::min(budget, shared_memory);
+    const size_t batch_memory = std::max<size_t>(1, budget / 6);
+    const size_t row_memory = (packed ? sizeof(packed_sequence) : sizeof(std::string)) +
+	sizeof(int) * num_subs;
+
+    std::atexit(remove_unfinished_sketch_file);
     for(const std::string& file : input_files)
-    {	
-	fasta_reader fin(file);
-		
-	std::vector<std::string> seqs;
-	fin.read_all(seqs);
-	size_t ct = seqs.size();
+    {
+	std::cout << "Sketching sequence(s) in file: " << file << std::endl;
 
-	std::cout << "Sketching " << ct << " sequence(s) in file: " << file << std::endl;
+	// written under a temporary name and renamed once complete
+	std::string out_file = change_file_ext(file, ext_name);
+	std::string tmp_file = out_file + ".tmp";
+	std::ofstream fout(tmp_file, std::ios::binary);
+	if(!fout)
+	{
+	    std::cerr << "Error: could not open the file: "
+		      << tmp_file << std::endl;
+	    std::exit(1);
+	}
+	unfinished_sketch_file = tmp_file;
+	// the number of sequences is filled in after all rows are written
+	sss_header header(0, num_subs, subs.num_tokens, subs.token_len,
+			  subs.fingerprint());
+	sss_array::write_header(header, fout);
 
-	Eigen::MatrixXi sketches(ct, num_subs);
+	bounded_queue<sketch_batch> to_sketch(1);
+	bounded_queue<sketch_batch> to_write(1);
 
-	std::vector<std::pair<size_t, int> > pairs;
-	pairs.reserve(ct * num_subs);
-	
-	for(size_t i = 0; i < ct; ++i)
+	std::thread reader([&]()
 	{
-	    for(int j = 0; j < num_subs; ++j)
+	    fasta_reader fin(file);
+	    while(!fin.eof())
 	    {
-		pairs.emplace_back(i, j);
+		sketch_batch batch;
+		size_t memory = 0;
+		while(!fin.eof() && memory < batch_memory)
+		{
+		    if(packed)
+		    {
+			batch.packed.emplace_back();
+			fin.next_packed(subs.codes(), batch.packed.back());
+			memory += batch.packed.back().memory() + row_memory;
+		    }
+		    else
+		    {
+			batch.seqs.push_back(fin.next());
+			memory += batch.seqs.back().size() + row_memory;
+		    }
+		}
+		to_sketch.push(std::move(batch));
 	    }
-	}
+	    to_sketch.close();
+	});
 
-#pragma omp parallel for default(shared)
-	for(const std::pair<size_t, int>& p : pairs)
+	// batches are sketched in order, so rows are appended in input order
+	size_t ct = 0;
+	std::vector<uint64_t> sq_norms;
+	std::thread writer([&]()
 	{
-	    sketches(p.first, p.second) = longest_subsequence(seqs[p.first], subs.seqs[p.second], subs.token_len);
-	}
+	    sketch_batch batch;
+	    while(to_write.pop(batch))
+	    {
+		sss_array::write_rows(batch.sketches, header, fout);
+		sss_array::squared_norms(batch.sketches, sq_norms);
+		ct += batch.sketches.rows();
+	    }
+	});
 
-	std::string out_file = change_file_ext(file, ext_name);
-	sss_array::write_all(sketches, ct, num_subs, subs.num_tokens, out_file);
+	sketch_batch batch;
+	while(to_sketch.pop(batch))
+	{
+	    if(packed) sketch_batch_seqs(subs, engine, bitscan.get(), batch.packed, batch.sketches);
+	    else sketch_batch_seqs(subs, engine, bitscan.get(), batch.seqs, batch.sketches);
+	    std::vector<std::string>().swap(batch.seqs);
+	    std::vector<packed_sequence>().swap(batch.packed);
+	    to_write.push(std::move(batch));
+	}
+	to_write.close();
+
+	reader.join();
+	writer.join();
+	sss_array::write_norms(sq_norms, fout);
+	fout.seekp(0);
+	header.num_sketches = ct;
+	header.flags |= SSS_HAS_NORMS;
+	sss_array::write_header(header, fout);
+	fout.close();
+	if(!fout || std::rename(tmp_file.c_str(), out_file.c_str()) != 0)
+	{
+	    std::cerr << "Error: could not write to the file: "
+		      << out_file << std::endl;
+	    std::exit(1);
+	}
+	unfinished_sketch_file.clear();
 	
 	std::cout << "Finished " << ct << " sequence(s), sketching wrote to file "
 		  << out_file << std::endl;
@@ -335,44 +971,70 @@ void compute_sketchings(const std::string& subseq_file,
 
 void compute_distances(const std::string& sketch_file1,
 		       const std::string& sketch_file2,
-		       const std::string& dist_file)
+		       const std::string& dist_file,
+		       size_t tile, size_t max_memory, double max_dist,
+		       tiled_dist::precision prec)
 {
     std::cout << "sketch_file1: " << sketch_file1 << std::endl;
     std::cout << "sketch_file2: " << sketch_file2 << std::endl;
     std::cout << "dist_file: " << dist_file << std::endl << std::endl;
 
-    std::cout << "Loading sketchings from the file: " << sketch_file1 << std::endl;
-    size_t num_sketches1;
-    int sketch_dim1;
-    int num_tokens1;
-    Eigen::MatrixXi sketches1 = sss_array::load_all(num_sketches1, sketch_dim1, num_tokens1, sketch_file1);
-    std::cout << "Loaded " << num_sketches1 << " sketchings from "
-	      << sketch_file1 << ", dimension: " << sketch_dim1 << std::endl;
-
-    std::cout << "Loading sketchings from the file: " << sketch_file2 << std::endl;
-    size_t num_sketches2;
-    int sketch_dim2;
-    int num_tokens2;
-    Eigen::MatrixXi sketches2 = sss_array::load_all(num_sketches2, sketch_dim2, num_tokens2, sketch_file2);
-    std::cout << "Loaded " << num_sketches2 << " sketchings from "
-	      << sketch_file2 << ", dimension: " << sketch_dim2 << std::endl;
-
-    if(sketch_dim1 != sketch_dim2)
-    {
-	std::cerr << "Error: sketching dimensions do not match." << std::endl;
-	std::exit(1);
+    // the payloads are mapped, so incompatible files are refused before
+    // any sketching is paged in
+    sss_mapped mapped1(sketch_file1);
+    sss_mapped mapped2(sketch_file2);
+    sss_array::check_compatible(mapped1.header(), sketch_file1,
+				mapped2.header(), sketch_file2);
+    size_t num_sketches1 = mapped1.rows();
+    size_t num_sketches2 = mapped2.rows();
+
+    // normalized sketchings and the distance matrix held all at once
+    size_t max_bytes = max_memory << 20;
+    double full_bytes = sizeof(double) *
+	(double(num_sketches1 + num_sketches2) * mapped1.cols() +
+	 double(num_sketches1) * num_sketches2);
+    if(tile == 0 && (full_bytes > max_bytes || max_dist >= 0))
+    {
+	tile = tiled_dist::tile_size(mapped1.cols(), max_bytes, omp_get_max_threads());
+    }
+    else if(tile == 0 && (prec != tiled_dist::DOUBLE ||
+			  (mapped1.squared_norms() && mapped2.squared_norms())))
+    {
+	// rows are divided by their norms as they are converted from the
+	// mapped files; the products of a tile run on one thread, so the
+	// tiles are only small enough to keep all threads busy
+	tile = tiled_dist::parallel_tile_size(num_sketches1, num_sketches2, false,
+					      omp_get_max_threads());
     }
 
-    if(num_tokens1 != num_tokens2)
+    if(max_dist >= 0)
     {
-	std::cerr << "Warning: max possible values in the sketchings are not consistent, #1: "
-		  << num_tokens1 << ", #2: " << num_tokens2
-		  << ". The results may not be meaningful." << std::endl;
+	save_sparse_distances(tiled_dist(mapped1, mapped2, tile, prec), max_dist, dist_file);
+	return;
     }
 
-    std::cout << "Computing pairwise sketching distances..." << std::endl;
-    // sss_array::pairwise_cos_dist(sketches1, sketches2, sketch_dim1, dist_file);
-    sss_array::pairwise_cos_dist(sketches1, sketches2, dist_file);
+    if(tile > 0)
+    {
+	std::cout << "Computing pairwise sketching distances in tiles of "
+		  << tile << "x" << tile << "..." << std::endl;
+	tiled_dist(mapped1, mapped2, tile, prec).save(dist_file);
+    }
+    else
+    {
+	std::cout << "Loading sketchings from the file: " << sketch_file1 << std::endl;
+	Eigen::MatrixXd sketches1 = mapped1.all<double>();
+	std::cout << "Loaded " << num_sketches1 << " sketchings from "
+		  << sketch_file1 << ", dimension: " << mapped1.cols() << std::endl;
+
+	std::cout << "Loading sketchings from the file: " << sketch_file2 << std::endl;
+	Eigen::MatrixXd sketches2 = mapped2.all<double>();
+	std::cout << "Loaded " << num_sketches2 << " sketchings from "
+		  << sketch_file2 << ", dimension: " << mapped2.cols() << std::endl;
+
+	std::cout << "Computing pairwise sketching distances..." << std::endl;
+	// sss_array::pairwise_cos_dist(sketches1, sketches2, sketch_dim1, dist_file);
+	sss_array::pairwise_cos_dist(sketches1, sketches2, dist_file);
+    }
     std::cout << num_sketches1 << "x" << num_sketches2
 	      << " sketching distance matrix wrote to file: "
 	      << dist_file << std::endl;
@@ -382,37 +1044,422 @@ void compute_distances(const std::string& sketch_file1,
 }
 
 
-void show_sketchings(const std::string& sketch_file)
+void compute_self_distances(const std::string& sketch_file,
+			    const std::string& dist_file,
+			    bool condensed, size_t tile, size_t max_memory,
+			    double max_dist, tiled_dist::precision prec)
+{
+    std::cout << "sketch_file: " << sketch_file << std::endl;
+    std::cout << "dist_file: " << dist_file << std::endl << std::endl;
+
+    sss_mapped mapped(sketch_file);
+    size_t num_sketches = mapped.rows();
+    std::cout << "Loaded " << num_sketches << " sketchings from "
+	      << sketch_file << ", dimension: " << mapped.cols() << std::endl;
+
+    // if the normalized sketchings and the distances fit, the tiles are
+    // only small enough to keep all threads busy
+    size_t max_bytes = max_memory << 20;
+    double full_bytes = sizeof(double) *
+	(double(num_sketches) * mapped.cols() + double(num_sketches) * num_sketches);
+    if(tile == 0)
+    {
+	tile = full_bytes > max_bytes || max_dist >= 0 ?
+	    tiled_dist::tile_size(mapped.cols(), max_bytes, omp_get_max_threads()) :
+	    tiled_dist::parallel_tile_size(num_sketches, num_sketches, true, omp_get_max_threads());
+    }
+
+    std::cout << "Computing symmetric sketching distances in tiles of "
+	      << tile << "x" << tile << "..." << std::endl;
+    tiled_dist dist(mapped, tile, prec);
+    if(max_dist >= 0)
+    {
+	save_sparse_distances(dist, max_dist, dist_file);
+    }
+    else if(condensed)
+    {
+	dist.save_condensed(dist_file);
+	std::cout << num_sketches * (num_sketches - std::min<size_t>(num_sketches, 1)) / 2
+		  << " condensed sketching distances wrote to file: "
+		  << dist_file << std::endl;
+    }
+    else
+    {
+	dist.save(dist_file);
+	std::cout << num_sketches << "x" << num_sketches
+		  << " sketching distance matrix wrote to file: "
+		  << dist_file << std::endl;
+    }
+}
+
+
+void save_sparse_distances(const tiled_dist& dist, double max_dist,
+			   const std::string& dist_file)
+{
+    std::cout << "Keeping the sketching distances not larger than "
+	      << max_dist << " in tiles of " << dist.tile() << "x"
+	      << dist.tile() << "..." << std::endl;
+    sparse_dist sparse = dist.within(max_dist);
+    sparse.save(dist_file);
+
+    double ratio = dist.rows() * dist.cols() > 0 ?
+	double(sparse.nnz()) / (double(dist.rows()) * dist.cols()) : 0;
+    std::cout << sparse.nnz() << " of " << dist.rows() << "x" << dist.cols()
+	      << " sketching distances (" << ratio * 100
+	      << "%) wrote to file: " << dist_file << std::endl;
+}
+
+
+void lsh_distances(const std::string& sketch_file1,
+		   const std::string& sketch_file2,
+		   const std::string& dist_file,
+		   size_t bands, size_t band_rows, size_t max_bucket,
+		   double max_dist)
 {
-    size_t num_sketches;
-    int sketch_dim;
-    int num_tokens;
+    std::cout << "sketch_file1: " << sketch_file1 << std::endl;
+    if(!sketch_file2.empty())
+    {
+	std::cout << "sketch_file2: " << sketch_file2 << std::endl;
+    }
+    std::cout << "dist_file: " << dist_file << std::endl << std::endl;
+
+    // an empty sketch_file2 means the distances within sketch_file1
+    sss_mapped mapped1(sketch_file1);
+    std::unique_ptr<sss_mapped> mapped2;
+    std::unique_ptr<lsh_dist> lsh;
+    if(sketch_file2.empty())
+    {
+	lsh.reset(new lsh_dist(mapped1, bands, band_rows, max_bucket));
+    }
+    else
+    {
+	mapped2.reset(new sss_mapped(sketch_file2));
+	sss_array::check_compatible(mapped1.header(), sketch_file1,
+				    mapped2->header(), sketch_file2);
+	lsh.reset(new lsh_dist(mapped1, *mapped2, bands, band_rows, max_bucket));
+    }
+
+    std::cout << "Hashing sketchings into " << bands << " bands of "
+	      << band_rows << " random hyperplanes..." << std::endl;
+    std::vector<uint64_t> pairs = lsh->candidates();
+    std::cout << pairs.size() << " candidate pairs, keeping the sketching distances not larger than "
+	      << max_dist << "..." << std::endl;
 
+    sparse_dist sparse = lsh->verify(pairs, max_dist);
+    sparse.save(dist_file);
+
+    double ratio = lsh->rows() * lsh->cols() > 0 ?
+	double(sparse.nnz()) / (double(lsh->rows()) * lsh->cols()) : 0;
+    std::cout << sparse.nnz() << " of " << lsh->rows() << "x" << lsh->cols()
+	      << " sketching distances (" << ratio * 100
+	      << "%) wrote to file: " << dist_file << std::endl;
+}
+
+
+void find_neighbors(const std::string& query_file,
+		    const std::string& ref_file,
+		    const std::string& knn_file,
+		    size_t k, size_t tile, tiled_dist::precision prec)
+{
+    std::cout << "query_file: " << query_file << std::endl;
+    std::cout << "ref_file: " << ref_file << std::endl;
+    std::cout << "knn_file: " << knn_file << std::endl << std::endl;
+
+    sss_mapped queries(query_file);
+    sss_mapped refs(ref_file);
+    sss_array::check_compatible(queries.header(), query_file,
+				refs.header(), ref_file);
+    std::cout << "Loaded " << queries.rows() << " query sketchings and "
+	      << refs.rows() << " reference sketchings, dimension: "
+	      << queries.cols() << std::endl;
+
+    std::ofstream fout(knn_file);
+    if(!fout)
+    {
+	std::cerr << "Error: could not write to the file: "
+		  << knn_file << std::endl;
+	std::exit(1);
+    }
+
+    std::cout << "Searching " << k << " nearest references in blocks of "
+	      << tile << "x" << tile << "..." << std::endl;
+    std::vector<std::vector<tiled_dist::neighbor> > neighbors =
+	tiled_dist(queries, refs, tile, prec).nearest(k);
+
+    // enough digits for the distances to be read back exactly
+    fout << std::setprecision(std::numeric_limits<double>::max_digits10);
+    for(size_t i = 0; i < neighbors.size(); ++i)
+    {
+	for(const tiled_dist::neighbor& x : neighbors[i])
+	{
+	    fout << i << '\t' << x.second << '\t' << x.first << '\n';
+	}
+    }
+    fout.close();
+
+    std::cout << "Nearest references of " << neighbors.size()
+	      << " queries wrote to file: " << knn_file << std::endl;
+}
+
+
+void build_tree(const std::string& sketch_file,
+		const std::string& dist_file,
+		const std::string& labels_file,
+		const std::string& tree_file,
+		size_t tile, size_t max_memory)
+{
+    std::cout << (sketch_file.empty() ? "dist_file: " + dist_file : "sketch_file: " + sketch_file) << std::endl;
+    std::cout << "tree_file: " << tree_file << std::endl << std::endl;
+
+    std::vector<std::string> labels;
+    if(!labels_file.empty())
+    {
+	std::ifstream fin(labels_file);
+	std::string line;
+	while(std::getline(fin, line))
+	{
+	    if(!line.empty()) labels.push_back(line);
+	}
+    }
+
+    // the distances go straight from the tiles into the tree, no
+    // distance matrix is written
+    std::unique_ptr<nj_tree> nj;
+    if(sketch_file.empty())
+    {
+	std::cout << "Loading distances from the file: " << dist_file << std::endl;
+	nj.reset(new nj_tree(dist_file));
+    }
+    else
+    {
+	sss_mapped mapped(sketch_file);
+	if(tile == 0)
+	{
+	    tile = tiled_dist::tile_size(mapped.cols(), max_memory << 20, omp_get_max_threads());
+	}
+	std::cout << "Computing symmetric sketching distances of " << mapped.rows()
+		  << " sketchings in tiles of " << tile << "x" << tile << "..." << std::endl;
+	nj.reset(new nj_tree(tiled_dist(mapped, tile)));
+    }
+
+    std::cout << "Joining " << nj->size() << " leaves..." << std::endl;
+    nj->build();
+    nj->save_newick(tree_file, labels);
+
+    std::cout << "Neighbor-joining tree of " << nj->size()
+	      << " leaves wrote to file: " << tree_file << std::endl;
+}
+
+
+void cluster_sketchings(const std::string& sketch_file,
+			const std::string& cluster_file,
+			double max_dist, size_t k, size_t max_iter, uint64_t seed,
+			size_t tile, size_t max_memory)
+{
+    std::cout << "sketch_file: " << sketch_file << std::endl;
+    std::cout << "cluster_file: " << cluster_file << std::endl << std::endl;
+
+    sss_mapped mapped(sketch_file);
+    std::cout << "Loaded " << mapped.rows() << " sketchings from "
+	      << sketch_file << ", dimension: " << mapped.cols() << std::endl;
+
+    std::ofstream fout(cluster_file);
+    if(!fout)
+    {
+	std::cerr << "Error: could not write to the file: "
+		  << cluster_file << std::endl;
+	std::exit(1);
+    }
+
+    std::vector<size_t> clusters;
+    if(max_dist >= 0)
+    {
+	if(tile == 0)
+	{
+	    tile = tiled_dist::tile_size(mapped.cols(), max_memory << 20, omp_get_max_threads());
+	}
+	std::cout << "Linking the sketchings within " << max_dist << " in tiles of "
+		  << tile << "x" << tile << "..." << std::endl;
+	clusters = sketch_clusters::single_linkage(mapped, max_dist, tile);
+    }
+    else
+    {
+	std::cout << "Clustering the sketchings around " << k << " medoids..." << std::endl;
+	size_t iterations;
+	clusters = sketch_clusters::k_medoids(mapped, k, max_iter, seed, iterations);
+	std::cout << "Stopped after " << iterations << " iterations" << std::endl;
+    }
+
+    std::vector<size_t> names(clusters);
+    std::sort(names.begin(), names.end());
+    size_t num_clusters = std::unique(names.begin(), names.end()) - names.begin();
+
+    for(size_t i = 0; i < clusters.size(); ++i)
+    {
+	fout << i << '\t' << clusters[i] << '\n';
+    }
+    fout.close();
+
+    std::cout << num_clusters << " clusters of " << clusters.size()
+	      << " sketchings wrote to file: " << cluster_file << std::endl;
+}
+
+
+void build_index(const std::vector<std::string>& sketch_files,
+		 const std::string& index_file,
+		 size_t M, size_t ef_construction, uint64_t seed)
+{
+    std::cout << "index_file: " << index_file << std::endl;
+    std::cout << "M: " << M << std::endl;
+    std::cout << "ef_construction: " << ef_construction << std::endl << std::endl;
+
+    std::cout << "Indexing sketchings of " << sketch_files.size()
+	      << " files with " << omp_get_max_threads() << " threads..." << std::endl;
+    hnsw_index index(sketch_files, M, ef_construction, seed);
+    index.save(index_file);
+
+    std::cout << "Index of " << index.size() << " sketchings, dimension: "
+	      << index.dim() << ", wrote to file: " << index_file << std::endl;
+}
+
+
+void query_index(const std::string& index_file,
+		 const std::string& query_file,
+		 const std::string& knn_file,
+		 size_t k, size_t ef)
+{
+    std::cout << "index_file: " << index_file << std::endl;
+    std::cout << "query_file: " << query_file << std::endl;
+    std::cout << "knn_file: " << knn_file << std::endl << std::endl;
+
+    hnsw_index index(index_file);
+    sss_mapped queries(query_file);
+    sss_array::check_compatible(index.sketch_header(), index_file,
+				queries.header(), query_file);
+    std::cout << "Loaded an index of " << index.size() << " sketchings and "
+	      << queries.rows() << " query sketchings, dimension: "
+	      << index.dim() << std::endl;
+
+    std::ofstream fout(knn_file);
+    if(!fout)
+    {
+	std::cerr << "Error: could not write to the file: "
+		  << knn_file << std::endl;
+	std::exit(1);
+    }
+
+    std::cout << "Searching " << k << " nearest sketchings with ef "
+	      << std::max(k, ef) << "..." << std::endl;
+    std::vector<std::vector<hnsw_index::neighbor> > neighbors(queries.rows());
+#pragma omp parallel
+    {
+	hnsw_index::visited_list visited(index.size());
+	std::vector<float> x(index.dim());
+#pragma omp for schedule(dynamic, 64)
+	for(long long i = 0; i < static_cast<long long>(queries.rows()); ++i)
+	{
+	    hnsw_index::normalized_rows(queries, i, 1, x.data());
+	    neighbors[i] = index.search(x.data(), k, ef, visited);
+	}
+    }
+
+    // enough digits for the distances to be read back exactly
+    fout << std::setprecision(std::numeric_limits<float>::max_digits10);
+    for(size_t i = 0; i < neighbors.size(); ++i)
+    {
+	for(const hnsw_index::neighbor& x : neighbors[i])
+	{
+	    fout << i << '\t' << x.second << '\t' << x.first << '\n';
+	}
+    }
+    fout.close();
+
+    std::cout << "Nearest sketchings of " << neighbors.size()
+	      << " queries wrote to file: " << knn_file << std::endl;
+}
+
+
+// Number of rows of sketch_len values copied out of a mapped sketching
+// file at a time.
+size_t rows_per_block(size_t sketch_len)
+{
+    const size_t block_bytes = 64 << 20;
+    return std::max<size_t>(1, block_bytes / (sizeof(int) * std::max<size_t>(1, sketch_len)));
+}
+
+void show_sketchings(const std::string& sketch_file)
+{
     std::cout << "Loading sketchings from the file: " << sketch_file << std::endl;
     // sss_array::load(sketches, sketch_dim, num_tokens, sketch_file);
-    Eigen::MatrixXi sketches = sss_array::load_all(num_sketches, sketch_dim, num_tokens, sketch_file);
-
-    std::cout << "Sketching dimension: " << sketch_dim << std::endl;
-    std::cout << "Max possible value: " << num_tokens << std::endl;
-    std::cout << "Number of sketchings: " << num_sketches << std::endl;   
+    sss_mapped sketches(sketch_file);
+    const sss_header& header = sketches.header();
+
+    std::cout << "Format version: " << header.version << std::endl;
+    std::cout << "Sketching dimension: " << header.sketch_len << std::endl;
+    std::cout << "Max possible value: " << header.max_val << std::endl;
+    std::cout << "Token length: " << header.token_len << std::endl;
+    std::cout << "Subsequence fingerprint: " << std::hex << header.subseq_hash
+	      << std::dec << std::endl;
+    std::cout << "Number of sketchings: " << header.num_sketches << std::endl;   
+    std::cout << "Squared norms stored: "
+	      << (sketches.squared_norms() ? "yes" : "no") << std::endl;
+
+    // values are right aligned to the widest one, one block of rows is
+    // copied out of the mapped file at a time
+    size_t step = rows_per_block(sketches.cols());
+    int max_val = 0;
+    for(size_t i = 0; i < sketches.rows(); i += step)
+    {
+	size_t n = std::min(step, sketches.rows() - i);
+	max_val = std::max(max_val, sketches.block<int>(i, n).maxCoeff());
+    }
+    int width = std::to_string(max_val).size();
 
-    Eigen::IOFormat fmt(0, 0, " ", "\n");
-    std::cout << sketches.format(fmt) << std::endl;
+    for(size_t i = 0; i < sketches.rows(); i += step)
+    {
+	size_t n = std::min(step, sketches.rows() - i);
+	Eigen::MatrixXi rows = sketches.block<int>(i, n);
+	for(Eigen::Index r = 0; r < rows.rows(); ++r)
+	{
+	    for(Eigen::Index c = 0; c < rows.cols(); ++c)
+	    {
+		if(c > 0) std::cout << ' ';
+		std::cout << std::setw(width) << rows(r, c);
+	    }
+	    if(i + r + 1 < sketches.rows()) std::cout << '\n';
+	}
+    }
+    std::cout << std::endl;
 }
 
 
 void show_distances(const std::string& dist_file, bool to_stdout)
 {
     std::cout << "Loading distances from the file: " << dist_file << std::endl;
-    sss_array::load_dist_matrix(dist_file, to_stdout);
+    if(!sparse_dist::is_sparse_file(dist_file))
+    {
+	sss_array::load_dist_matrix(dist_file, to_stdout);
+	return;
+    }
+
+    sparse_dist dist = sparse_dist::load(dist_file);
+    std::cout << "Loaded " << dist.rows << "x" << dist.cols
+	      << " sparse distance matrix with " << dist.nnz()
+	      << " distances not larger than " << dist.max_dist << std::endl;
+    if(to_stdout)
+    {
+	dist.show();
+    }
+    else
+    {
+	dist.save_npz(dist_file + ".npz");
+    }
 }
 
 void merge_sketchings(const std::vector<std::string>& sketch_files,
 		      const std::string& out_file)
 {
     size_t num_sketches = 0;
-    int sketch_dim = -1;
-    int num_tokens = -1;
 
     std::cout << "Merging" << std::endl << "input_files:";
     for(const std::string& s : sketch_files)
@@ -422,53 +1469,64 @@ void merge_sketchings(const std::vector<std::string>& sketch_files,
     std::cout << std::endl << "to out_file: " << out_file
 	      << std::endl << std::endl;
 
+    // refuse incompatible sketchings before loading them
     int ct = sketch_files.size();
-    Eigen::MatrixXi sketches[ct];
-    for(int i = 0; i < ct; ++ i)
+    std::vector<sss_header> headers(ct);
+    for(int i = 0; i < ct; ++i)
     {
-	std::cout << "Loading sketchings from the file: " << sketch_files[i] << std::endl;
-	size_t cur_num_sketches;
-	int cur_sketch_dim;
-	int cur_num_tokens;
-        sketches[i] = sss_array::load_all(cur_num_sketches,
-					   cur_sketch_dim,
-					   cur_num_tokens,
-					   sketch_files[i]);
-	if(sketch_dim < 0)
-	{
-	    sketch_dim = cur_sketch_dim;
-	}
-	else if(sketch_dim != cur_sketch_dim)
-	{
-	    std::cerr << "Error: cannot merge sketching matrices with different sketching dimension, was "
-		      << sketch_dim << ", " << sketch_files[i] << " is "
-		      << cur_sketch_dim << std::endl;
-	    std::exit(1);
-	}
+	sss_array::read_header(sketch_files[i], headers[i]);
+	sss_array::check_compatible(headers[0], sketch_files[0],
+				    headers[i], sketch_files[i]);
+	num_sketches += headers[i].num_sketches;
+    }
 
-	if(num_tokens < 0)
-	{
-	    num_tokens = cur_num_tokens;
-	}
-	else if(num_tokens != cur_num_tokens)
-	{
-	    std::cerr << "Warning: merge sketching matrices with different max possible values, was "
-		      << num_tokens << ", " << sketch_files[i] << " is "
-		      << cur_num_tokens << std::endl;
-	}
+    // the merged file keeps the fingerprint only if all inputs have it
+    sss_header header(num_sketches, headers[0].sketch_len, headers[0].max_val,
+		      headers[0].token_len, headers[0].subseq_hash);
+    for(const sss_header& h : headers)
+    {
+	header.max_val = std::max(header.max_val, h.max_val);
+	if(h.subseq_hash == 0) header.subseq_hash = 0;
+	if(h.token_len != header.token_len) header.token_len = 0;
+    }
+    header.cell_bytes = sss_array::cell_bytes(header.max_val);
+    header.flags |= SSS_HAS_NORMS;
 
-	num_sketches += cur_num_sketches;
+    std::ofstream fout(out_file, std::ios::binary);
+    if(!fout)
+    {
+	std::cerr << "Error: could not open the file: "
+		  << out_file << std::endl;
+	std::exit(1);
     }
+    sss_array::write_header(header, fout);
 
-    Eigen::MatrixXi all(num_sketches, sketch_dim);
-    size_t current_row = 0;
+    // copy one block of rows at a time from the mapped input files, the
+    // squared norms are copied or computed if the input has none
+    std::vector<uint64_t> sq_norms;
     for(int i = 0; i < ct; ++i)
     {
-	all.block(current_row, 0, sketches[i].rows(), sketch_dim) = sketches[i];
-	current_row += sketches[i].rows();
+	std::cout << "Loading sketchings from the file: " << sketch_files[i] << std::endl;
+	sss_mapped sketches(sketch_files[i]);
+	size_t step = rows_per_block(sketches.cols());
+	for(size_t j = 0; j < sketches.rows(); j += step)
+	{
+	    size_t n = std::min(step, sketches.rows() - j);
+	    Eigen::MatrixXi rows = sketches.block<int>(j, n);
+	    sss_array::write_rows(rows, header, fout);
+	    if(!sketches.squared_norms())
+	    {
+		sss_array::squared_norms(rows, sq_norms);
+	    }
+	}
+	if(sketches.squared_norms())
+	{
+	    sq_norms.insert(sq_norms.end(), sketches.squared_norms(),
+			    sketches.squared_norms() + sketches.rows());
+	}
     }
-
-    sss_array::write_all(all, num_sketches, sketch_dim, num_tokens, out_file);
+    sss_array::write_norms(sq_norms, fout);
+    fout.close();
 	
     std::cout << "Merged " << ct << " files, " << num_sketches
 	      << " sketchings in total,  wrote to file "
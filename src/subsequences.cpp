@@ -9,9 +9,11 @@
 #include <fstream>
 #include <sstream>
 #include <random>
+#include <algorithm>
 
 subsequences::subsequences(int subseq_len, int token_len)
-    :token_len(token_len), num_tokens(subseq_len)
+    :token_len(token_len), num_tokens(subseq_len), num_distinct_tokens(0),
+     code_bits(0), code_mask(0)
 {}
 
 subsequences::subsequences(const std::string& subseq_file)
@@ -89,12 +91,122 @@ void subsequences::load_subsequences(const std::string& subseq_file)
 
     seqs.reserve(num_seqs);
     std::string s;
+    const std::size_t seq_len = static_cast<std::size_t>(num_tokens) * token_len;
     while(std::getline(fin, s))
     {
+	if(!s.empty() && s.back() == '\r') s.pop_back();
+	// blank lines (e.g., at the end of the file) are not subsequences
+	if(s.empty()) continue;
+	if(s.size() != seq_len)
+	{
+	    std::cerr << "Error: subsequence " << seqs.size() + 1 << " in the file "
+		      << subseq_file << " has " << s.size() << " characters, expecting "
+		      << seq_len << std::endl;
+	    std::exit(1);
+	}
 	seqs.push_back(std::move(s));
     }
 
     fin.close();
+
+    encode_tokens();
+}
+
+void subsequences::encode_tokens()
+{
+    std::fill(char_codes, char_codes + 256, -1);
+
+    bool is_dna = true;
+    for(const std::string& s : seqs)
+    {
+	is_dna = is_dna && s.find_first_not_of("ACGT") == std::string::npos;
+    }
+
+    int alphabet_size = 0;
+    if(is_dna)
+    {
+	char_codes['A'] = 0;
+	char_codes['C'] = 1;
+	char_codes['G'] = 2;
+	char_codes['T'] = 3;
+	alphabet_size = 4;
+    }
+    else
+    {
+	for(const std::string& s : seqs)
+	{
+	    for(char c : s)
+	    {
+		int& code = char_codes[static_cast<unsigned char>(c)];
+		if(code < 0) code = alphabet_size++;
+	    }
+	}
+    }
+
+    code_bits = 1;
+    while((1 << code_bits) < alphabet_size) ++code_bits;
+    if(code_bits * token_len > 64) code_bits = 0;
+
+    if(code_bits > 0)
+    {
+	int total_bits = code_bits * token_len;
+	code_mask = total_bits == 64 ? ~0ULL : (1ULL << total_bits) - 1;
+	if(total_bits <= 20)
+	{
+	    code_table.assign(1 << total_bits, -1);
+	}
+    }
+    else
+    {
+	hash_pow = 1;
+	for(int i = 1; i < token_len; ++i) hash_pow *= hash_base;
+    }
+
+    // assumes each subsequence has num_tokens tokens of length token_len
+    token_ids.clear();
+    token_ids.reserve(seqs.size() * num_tokens);
+    num_distinct_tokens = 0;
+    for(const std::string& s : seqs)
+    {
+	for(int i = 0; i < num_tokens; ++i)
+	{
+	    uint64_t code = 0;
+	    for(int j = i * token_len; j < (i + 1) * token_len; ++j)
+	    {
+		int c = char_codes[static_cast<unsigned char>(s[j])];
+		if(code_bits > 0) code = (code << code_bits) | c;
+		else code = code * hash_base + (c + 1);
+	    }
+
+	    int id = find_code(code);
+	    if(code_bits == 0)
+	    {
+		while(id >= 0 && distinct_tokens[id].compare(0, token_len, s, i * token_len, token_len) != 0)
+		{
+		    id = same_hash_next[id];
+		}
+	    }
+
+	    if(id < 0)
+	    {
+		id = num_distinct_tokens++;
+		if(code_bits > 0)
+		{
+		    if(code_table.empty()) code_map[code] = id;
+		    else code_table[code] = id;
+		}
+		else
+		{
+		    // chain to the tokens with the same hash
+		    auto result = code_map.emplace(code, id);
+		    same_hash_next.push_back(result.second ? -1 : result.first->second);
+		    result.first->second = id;
+		    distinct_tokens.push_back(s.substr(i * token_len, token_len));
+		}
+	    }
+	    token_ids.push_back(id);
+	}
+    }
 }
 
 void subsequences::sample_subsequences(const std::string& reference, int num)
@@ -129,3 +241,27 @@ std::size_t subsequences::size() const
 {
     return seqs.size();
 }
+
+uint64_t subsequences::fingerprint() const
+{
+    // 64-bit FNV-1a, never 0 which is used for unknown
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto update = [&h](const std::string& s)
+    {
+	for(char c : s)
+	{
+	    h ^= static_cast<unsigned char>(c);
+	    h *= 0x100000001b3ULL;
+	}
+	h ^= '\n';
+	h *= 0x100000001b3ULL;
+    };
+
+    update(std::to_string(token_len) + " " + std::to_string(num_tokens));
+    for(const std::string& s : seqs)
+    {
+	update(s);
+    }
+
+    return h == 0 ? 1 : h;
+}
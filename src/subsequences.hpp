@@ -8,7 +8,11 @@
 #define __SUBSEQUENCES_H__
 
 #include <vector>
+#include <algorithm>
 #include <string>
+#include <unordered_map>
+#include <cstdint>
+#include "packed_sequence.hpp"
 
 class subsequences
 {
@@ -17,6 +21,12 @@ public:
     int num_tokens;
     std::vector<std::string> seqs;
 
+    // Tokens of the loaded subsequences are encoded once as dense integer ids
+    // in [0, num_distinct_tokens). The id of the k-th token of the j-th
+    // subsequence is token_ids[j * num_tokens + k].
+    std::vector<int> token_ids;
+    int num_distinct_tokens;
+
     // Initialize an empty list of subsequences.
     subsequences(int subseq_len, int token_len);
     // Load a list of subsequences from the given file.
@@ -36,9 +46,81 @@ public:
 
     std::size_t size() const;
 
+    // A 64-bit hash of token_len, num_tokens and all the subsequences, used
+    // to tell whether two sketchings are computed from the same subsequences.
+    uint64_t fingerprint() const;
+
+    // Call f(pos, id) for every position pos of seq (in increasing order)
+    // where the token starting at pos is one of the tokens of the loaded
+    // subsequences, id is the id of that token. Stop as soon as f returns
+    // false. The tokens of seq are rolled into integer codes, no strings
+    // are created.
+    template<typename F>
+    void for_each_token(const char* seq, std::size_t len, F f) const;
+    template<typename F>
+    void for_each_token(const std::string& seq, F f) const
+    {
+	for_each_token(seq.data(), seq.size(), f);
+    }
+
+    // Whether sequences can be given as packed_sequence: the subsequences
+    // have at most 4 distinct characters and a token is at most 32 of them.
+    bool packable() const { return code_bits == 2; }
+    // The code of each character for packed_sequence::append.
+    const int* codes() const { return char_codes; }
+
+    // for_each_token on the tokens of a packed sequence lying within
+    // [first, last), positions are relative to the start of seq. The code
+    // of a token is read from the packed words by one shift, requires
+    // packable().
+    template<typename F>
+    void for_each_token(const packed_sequence& seq, std::size_t first, std::size_t last, F f) const;
+    template<typename F>
+    void for_each_token(const packed_sequence& seq, F f) const
+    {
+	for_each_token(seq, 0, seq.size(), f);
+    }
+
 private:
+    // Code of each character appearing in the subsequences, -1 for others.
+    // Characters are coded as A=0, C=1, G=2, T=3 if the subsequences only
+    // contain ACGT, otherwise in order of first appearance.
+    int char_codes[256];
+    // Number of bits per character in a token code, 0 if a token does not
+    // fit in 64 bits, in which case tokens are located by a rolling hash.
+    int code_bits;
+    uint64_t code_mask;
+    // Map from a token code to its id (-1 if not a token), a direct table
+    // is used when the code space is small.
+    std::vector<int> code_table;
+    std::unordered_map<uint64_t, int> code_map;
+
+    // Used when tokens cannot be packed: each distinct token with its hash,
+    // tokens sharing a hash are chained by same_hash_next.
+    std::vector<std::string> distinct_tokens;
+    std::vector<int> same_hash_next;
+    uint64_t hash_pow;
+    static const uint64_t hash_base = 1000003;
+
+    // for_each_token on packed codes, with the token length (1 to 16) and
+    // the bits per character (2, as for DNA) as compile time constants so
+    // that the window update is a fixed shift and mask. A 0 argument
+    // stands for the run-time value.
+    template<int Bits, typename F>
+    void for_each_packed_token(const char* seq, std::size_t len, F f) const;
+    template<int TokenLen, int Bits, typename F>
+    void scan_packed(const char* seq, std::size_t len, F f) const;
+
+    // for_each_token by the rolling hash.
+    template<typename F>
+    void for_each_hashed_token(const char* seq, std::size_t len, F f) const;
+
     void load_subsequences(const std::string& subseq_file);
 
+    // Build char_codes and token_ids for the loaded subsequences.
+    void encode_tokens();
+    int find_code(uint64_t code) const;
+
     // Sample num subsequences from the given reference.
     // The reference is first split into num_tokens parts, one random token
     // is then sampled from each part to form a sampled subsequence.
@@ -46,4 +128,171 @@ private:
 };
 
 
+inline int subsequences::find_code(uint64_t code) const
+{
+    if(!code_table.empty()) return code_table[code];
+
+    auto it = code_map.find(code);
+    return it == code_map.end() ? -1 : it->second;
+}
+
+template<typename F>
+void subsequences::for_each_token(const char* seq, std::size_t len, F f) const
+{
+    if(code_bits == 0)
+    {
+	for_each_hashed_token(seq, len, f);
+    }
+    else if(code_bits == 2)
+    {
+	for_each_packed_token<2>(seq, len, f);
+    }
+    else
+    {
+	for_each_packed_token<0>(seq, len, f);
+    }
+}
+
+template<int Bits, typename F>
+void subsequences::for_each_packed_token(const char* seq, std::size_t len, F f) const
+{
+    switch(token_len)
+    {
+    case 1: scan_packed<1, Bits>(seq, len, f); break;
+    case 2: scan_packed<2, Bits>(seq, len, f); break;
+    case 3: scan_packed<3, Bits>(seq, len, f); break;
+    case 4: scan_packed<4, Bits>(seq, len, f); break;
+    case 5: scan_packed<5, Bits>(seq, len, f); break;
+    case 6: scan_packed<6, Bits>(seq, len, f); break;
+    case 7: scan_packed<7, Bits>(seq, len, f); break;
+    case 8: scan_packed<8, Bits>(seq, len, f); break;
+    case 9: scan_packed<9, Bits>(seq, len, f); break;
+    case 10: scan_packed<10, Bits>(seq, len, f); break;
+    case 11: scan_packed<11, Bits>(seq, len, f); break;
+    case 12: scan_packed<12, Bits>(seq, len, f); break;
+    case 13: scan_packed<13, Bits>(seq, len, f); break;
+    case 14: scan_packed<14, Bits>(seq, len, f); break;
+    case 15: scan_packed<15, Bits>(seq, len, f); break;
+    case 16: scan_packed<16, Bits>(seq, len, f); break;
+    default: scan_packed<0, Bits>(seq, len, f); break;
+    }
+}
+
+template<int TokenLen, int Bits, typename F>
+void subsequences::scan_packed(const char* seq, std::size_t len, F f) const
+{
+    // 0 stands for the run-time value
+    const int t = TokenLen > 0 ? TokenLen : token_len;
+    const int bits = Bits > 0 ? Bits : code_bits;
+    const uint64_t mask = TokenLen > 0 && Bits > 0 && TokenLen * Bits < 64 ?
+	(uint64_t(1) << (TokenLen * Bits % 64)) - 1 : code_mask;
+    const int* table = code_table.empty() ? nullptr : code_table.data();
+
+    uint64_t code = 0;
+    int valid = 0;
+    for(std::size_t i = 0; i < len; ++i)
+    {
+	int c = char_codes[static_cast<unsigned char>(seq[i])];
+	if(c < 0)
+	{
+	    valid = 0;
+	    continue;
+	}
+
+	code = ((code << bits) | c) & mask;
+	if(valid < t) ++valid;
+	if(valid == t)
+	{
+	    int id = table ? table[code] : find_code(code);
+	    if(id >= 0 && !f(i + 1 - t, id)) return;
+	}
+    }
+}
+
+template<typename F>
+void subsequences::for_each_token(const packed_sequence& seq, std::size_t first,
+				  std::size_t last, F f) const
+{
+    const std::size_t t = token_len;
+    const int shift = 64 - 2 * token_len;
+    const int* table = code_table.empty() ? nullptr : code_table.data();
+    const std::vector<std::pair<std::size_t, std::size_t> >& gaps = seq.gaps();
+
+    last = std::min(last, seq.size());
+    std::size_t pos = first;
+    for(std::size_t g = seq.first_gap(first); pos + t <= last; ++g)
+    {
+	// the tokens between pos and the next gap are all valid, the first
+	// one is read at once and the next characters are shifted in from
+	// the following packed words
+	std::size_t stop = g < gaps.size() ? std::min(gaps[g].first, last) : last;
+	if(pos + t <= stop)
+	{
+	    uint64_t code = seq.window(pos) >> shift;
+	    uint64_t next = 0;
+	    int left = 0;
+	    for(std::size_t in = pos + t; ; ++pos, ++in)
+	    {
+		int id = table ? table[code] : find_code(code);
+		if(id >= 0 && !f(pos, id)) return;
+		if(in >= stop) break;
+
+		if(left == 0)
+		{
+		    next = seq.window(in);
+		    left = 32;
+		}
+		code = ((code << 2) | (next >> 62)) & code_mask;
+		next <<= 2;
+		--left;
+	    }
+	    ++pos;
+	}
+	if(g >= gaps.size()) break;
+	pos = std::max(pos, gaps[g].second);
+    }
+}
+
+template<typename F>
+void subsequences::for_each_hashed_token(const char* seq, std::size_t len, F f) const
+{
+    // code is a polynomial rolling hash of the current window
+    uint64_t code = 0;
+    int valid = 0;
+    for(std::size_t i = 0; i < len; ++i)
+    {
+	int c = char_codes[static_cast<unsigned char>(seq[i])];
+	if(c < 0)
+	{
+	    valid = 0;
+	    code = 0;
+	    continue;
+	}
+
+	if(valid == token_len)
+	{
+	    int out = char_codes[static_cast<unsigned char>(seq[i - token_len])];
+	    code -= (out + 1) * hash_pow;
+	}
+	else
+	{
+	    ++valid;
+	}
+	code = code * hash_base + (c + 1);
+
+	if(valid == token_len)
+	{
+	    std::size_t pos = i + 1 - token_len;
+	    for(int id = find_code(code); id >= 0; id = same_hash_next[id])
+	    {
+		if(distinct_tokens[id].compare(0, token_len, seq + pos, token_len) == 0)
+		{
+		    if(!f(pos, id)) return;
+		    break;
+		}
+	    }
+	}
+    }
+}
+
 #endif
@@ -0,0 +1,441 @@
+/*
+  Part of SubseqSketch.
+  Pairwise sketching distances computed tile by tile.
+  By Ke @ Penn State
+*/
+
+#include "tiled_dist.hpp"
+#include "int_gemm.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+// Write len bytes at offset of fd, exit on failure.
+void write_at(int fd, const char* data, std::size_t len, off_t offset,
+	      const std::string& file)
+{
+    while(len > 0)
+    {
+	ssize_t ct = pwrite(fd, data, len, offset);
+	if(ct <= 0)
+	{
+	    std::cerr << "Error: could not write to the file: "
+		      << file << std::endl;
+	    std::exit(1);
+	}
+	data += ct;
+	len -= ct;
+	offset += ct;
+    }
+}
+}
+
+tiled_dist::tiled_dist(const sss_mapped& sketch1, const sss_mapped& sketch2,
+		       std::size_t tile, precision prec)
+    : sketch1(sketch1), sketch2(sketch2), tile_len(std::max<std::size_t>(1, tile)),
+      symmetric(false), prec(prec)
+{
+    check_precision();
+    if(this->prec == INT)
+    {
+	norms1 = row_norms(sketch1, tile_len);
+	norms2 = row_norms(sketch2, tile_len);
+    }
+}
+
+tiled_dist::tiled_dist(const sss_mapped& sketch, std::size_t tile, precision prec)
+    : sketch1(sketch), sketch2(sketch), tile_len(std::max<std::size_t>(1, tile)),
+      symmetric(true), prec(prec)
+{
+    check_precision();
+    if(this->prec == INT)
+    {
+	norms1 = row_norms(sketch, tile_len);
+	norms2 = norms1;
+    }
+}
+
+void tiled_dist::check_precision()
+{
+    if(prec != INT) return;
+
+    double max_val = std::max(sketch1.header().max_val, sketch2.header().max_val);
+    if(max_val > 0x7fff || max_val * max_val * sketch1.cols() > 0x7fffffff)
+    {
+	std::cerr << "Warning: sketching values up to " << max_val
+		  << " may overflow the integer dot products, using double precision"
+		  << std::endl;
+	prec = DOUBLE;
+    }
+}
+
+std::size_t tiled_dist::tile_size(std::size_t sketch_len, std::size_t max_bytes,
+				  int threads)
+{
+    // 2 * tile * sketch_len + tile * tile doubles per thread
+    double per_thread = static_cast<double>(max_bytes) / sizeof(double) / std::max(1, threads);
+    double tile = -double(sketch_len) + std::sqrt(double(sketch_len) * sketch_len + per_thread);
+    return std::max<std::size_t>(1, tile);
+}
+
+std::size_t tiled_dist::parallel_tile_size(std::size_t rows, std::size_t cols,
+					  bool symmetric, int threads)
+{
+    const std::size_t min_tile = 64;
+    const std::size_t target = 2 * std::max(1, threads);
+    auto num_tiles = [&](std::size_t tile)
+    {
+	std::size_t r = (rows + tile - 1) / tile;
+	std::size_t c = (cols + tile - 1) / tile;
+	return symmetric ? r * (r + 1) / 2 : r * c;
+    };
+
+    // from an estimate of tiles of equal area, shrink until enough
+    double area = double(rows) * cols / (symmetric ? 2 : 1) / target;
+    std::size_t tile = std::max<std::size_t>(1, std::max(rows, cols));
+    tile = std::min<std::size_t>(tile, std::max(1.0, std::sqrt(area)));
+    while(tile > min_tile && num_tiles(tile) < target)
+    {
+	tile = std::max(min_tile, tile - std::max<std::size_t>(1, tile / 16));
+    }
+    return std::max(tile, std::min<std::size_t>(min_tile, std::max(rows, cols)));
+}
+
+Eigen::VectorXd tiled_dist::row_norms(const sss_mapped& sketch, std::size_t tile)
+{
+    Eigen::VectorXd norms(sketch.rows());
+    if(sketch.squared_norms())
+    {
+	// stored in the file, no pass over the sketchings
+	const uint64_t* sq_norms = sketch.squared_norms();
+	for(std::size_t i = 0; i < sketch.rows(); ++i)
+	{
+	    norms[i] = std::sqrt(double(sq_norms[i]));
+	}
+    }
+    else
+    {
+	for(std::size_t i = 0; i < sketch.rows(); i += tile)
+	{
+	    std::size_t n = std::min(tile, sketch.rows() - i);
+	    norms.segment(i, n) = sketch.block<double>(i, n).rowwise().norm();
+	}
+    }
+    norms = (norms.array() > 0).select(norms, 1.0);
+
+    return norms;
+}
+
+void tiled_dist::compute_tile(std::size_t i, std::size_t j, Eigen::MatrixXd& dist) const
+{
+    if(prec == FLOAT)
+    {
+	compute_float_tile(i, j, dist);
+	return;
+    }
+    if(prec == INT)
+    {
+	compute_int_tile(i, j, dist);
+	return;
+    }
+
+    std::size_t n1 = std::min(tile_len, rows() - i);
+    std::size_t n2 = std::min(tile_len, cols() - j);
+    Eigen::MatrixXd rows1 = sketch1.normalized_block<double>(i, n1);
+
+    if(symmetric && i == j)
+    {
+	// only the upper triangle, then mirrored
+	dist.setZero(n1, n1);
+	dist.selfadjointView<Eigen::Upper>().rankUpdate(rows1);
+	dist.triangularView<Eigen::StrictlyLower>() = dist.transpose();
+    }
+    else
+    {
+	Eigen::MatrixXd rows2 = sketch2.normalized_block<double>(j, n2);
+	dist.resize(n1, n2);
+	dist.noalias() = rows1 * rows2.transpose();
+    }
+    dist.array() = 1 - dist.array();
+    double zero_threshold = 1e-8;
+    dist = (dist.array() < zero_threshold).select(0.0, dist);
+}
+
+void tiled_dist::compute_float_tile(std::size_t i, std::size_t j, Eigen::MatrixXd& dist) const
+{
+    std::size_t n1 = std::min(tile_len, rows() - i);
+    std::size_t n2 = std::min(tile_len, cols() - j);
+    Eigen::MatrixXf rows1 = sketch1.normalized_block<float>(i, n1);
+
+    Eigen::MatrixXf prod;
+    if(symmetric && i == j)
+    {
+	prod.setZero(n1, n1);
+	prod.selfadjointView<Eigen::Upper>().rankUpdate(rows1);
+	prod.triangularView<Eigen::StrictlyLower>() = prod.transpose();
+    }
+    else
+    {
+	Eigen::MatrixXf rows2 = sketch2.normalized_block<float>(j, n2);
+	prod.resize(n1, n2);
+	prod.noalias() = rows1 * rows2.transpose();
+    }
+    dist = (1 - prod.array()).cast<double>();
+    double zero_threshold = 1e-6;
+    dist = (dist.array() < zero_threshold).select(0.0, dist);
+}
+
+void tiled_dist::compute_int_tile(std::size_t i, std::size_t j, Eigen::MatrixXd& dist) const
+{
+    typedef Eigen::Matrix<int16_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> int16_rows;
+
+    std::size_t n1 = std::min(tile_len, rows() - i);
+    std::size_t n2 = std::min(tile_len, cols() - j);
+    std::size_t stride = int_gemm::stride(sketch1.cols());
+
+    int16_rows rows1 = int16_rows::Zero(n1, stride);
+    rows1.leftCols(sketch1.cols()) = sketch1.block<int16_t>(i, n1);
+    int16_rows rows2;
+    if(!(symmetric && i == j))
+    {
+	rows2 = int16_rows::Zero(n2, stride);
+	rows2.leftCols(sketch2.cols()) = sketch2.block<int16_t>(j, n2);
+    }
+    const int16_rows& other = symmetric && i == j ? rows1 : rows2;
+
+    Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic> prod(n1, n2);
+    int_gemm::multiply(rows1.data(), n1, other.data(), n2, stride, prod.data());
+
+    // exact dot products, normalized at the end
+    dist = prod.cast<double>();
+    dist.array().colwise() /= norms1.segment(i, n1).array();
+    dist.array().rowwise() /= norms2.segment(j, n2).transpose().array();
+    dist.array() = 1 - dist.array();
+    double zero_threshold = 1e-8;
+    dist = (dist.array() < zero_threshold).select(0.0, dist);
+}
+
+void tiled_dist::save(const std::string& dist_file) const
+{
+    int fd = open(dist_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+	// throw std::runtime_error("Could not write to the file: " + dist_file);
+	std::cerr << "Error: could not write to the file: "
+		  << dist_file << std::endl;
+	std::exit(1);
+    }
+
+    // same layout as sss_array::save_dist_matrix, the file is allocated
+    // first and the column-major tiles are written into it column by column
+    int dims[2] = {static_cast<int>(rows()), static_cast<int>(cols())};
+    write_at(fd, reinterpret_cast<const char*>(dims), sizeof(dims), 0, dist_file);
+    off_t total = sizeof(dims) + sizeof(double) * rows() * cols();
+    if(ftruncate(fd, total) != 0)
+    {
+	std::cerr << "Error: could not allocate " << total
+		  << " bytes for the file: " << dist_file << std::endl;
+	std::exit(1);
+    }
+
+    const off_t header_bytes = sizeof(dims);
+    const std::size_t num_rows = rows();
+    for_each_tile([&](std::size_t i, std::size_t j, const Eigen::MatrixXd& dist)
+    {
+	for(Eigen::Index c = 0; c < dist.cols(); ++c)
+	{
+	    off_t offset = header_bytes + sizeof(double) * ((j + c) * num_rows + i);
+	    write_at(fd, reinterpret_cast<const char*>(dist.col(c).data()),
+		     sizeof(double) * dist.rows(), offset, dist_file);
+	}
+
+	// the mirrored tile below the diagonal
+	if(symmetric && i != j)
+	{
+	    Eigen::MatrixXd tran = dist.transpose();
+	    for(Eigen::Index c = 0; c < tran.cols(); ++c)
+	    {
+		off_t offset = header_bytes + sizeof(double) * ((i + c) * num_rows + j);
+		write_at(fd, reinterpret_cast<const char*>(tran.col(c).data()),
+			 sizeof(double) * tran.rows(), offset, dist_file);
+	    }
+	}
+    });
+
+    close(fd);
+}
+
+void tiled_dist::save_condensed(const std::string& dist_file) const
+{
+    int fd = open(dist_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+	std::cerr << "Error: could not write to the file: "
+		  << dist_file << std::endl;
+	std::exit(1);
+    }
+
+    const std::size_t n = rows();
+    const std::size_t len = n * (n - std::min<std::size_t>(n, 1)) / 2;
+    std::string header = sss_array::npy_header("<f8", false,
+					       "(" + std::to_string(len) + ",)");
+    write_at(fd, header.data(), header.size(), 0, dist_file);
+    const off_t header_bytes = header.size();
+    off_t total = header_bytes + sizeof(double) * len;
+    if(ftruncate(fd, total) != 0)
+    {
+	std::cerr << "Error: could not allocate " << total
+		  << " bytes for the file: " << dist_file << std::endl;
+	std::exit(1);
+    }
+
+    // row r of the upper triangle starts at n * r - r * (r + 1) / 2 and
+    // holds the distances to r + 1, ..., n - 1
+    for_each_tile([&](std::size_t i, std::size_t j, const Eigen::MatrixXd& dist)
+    {
+	Eigen::VectorXd row;
+	for(Eigen::Index r = 0; r < dist.rows(); ++r)
+	{
+	    std::size_t x = i + r;
+	    std::size_t first = std::max(j, x + 1);
+	    if(first >= j + dist.cols()) continue;
+
+	    row = dist.row(r).segment(first - j, j + dist.cols() - first).transpose();
+	    off_t offset = header_bytes + sizeof(double) * (n * x - x * (x + 1) / 2 + first - x - 1);
+	    write_at(fd, reinterpret_cast<const char*>(row.data()),
+		     sizeof(double) * row.size(), offset, dist_file);
+	}
+    });
+
+    close(fd);
+}
+
+std::vector<std::vector<tiled_dist::neighbor> > tiled_dist::nearest(std::size_t k) const
+{
+    std::vector<std::vector<neighbor> > heaps(rows());
+    if(k == 0) return heaps;
+
+    // one lock for the heaps of each tile of rows
+    std::vector<std::mutex> locks((rows() + tile_len - 1) / tile_len);
+
+    // push candidates of the rows [first, first + n) into their max-heaps
+    auto merge = [&](std::size_t first, std::vector<std::vector<neighbor> >& cands)
+    {
+	std::lock_guard<std::mutex> lock(locks[first / tile_len]);
+	for(std::size_t r = 0; r < cands.size(); ++r)
+	{
+	    std::vector<neighbor>& heap = heaps[first + r];
+	    for(const neighbor& x : cands[r])
+	    {
+		if(heap.size() < k)
+		{
+		    heap.push_back(x);
+		    std::push_heap(heap.begin(), heap.end());
+		}
+		else if(x < heap.front())
+		{
+		    std::pop_heap(heap.begin(), heap.end());
+		    heap.back() = x;
+		    std::push_heap(heap.begin(), heap.end());
+		}
+	    }
+	}
+    };
+
+    // the k nearest candidates of each row of dist
+    auto select = [k](const Eigen::MatrixXd& dist, std::size_t first_col,
+		      std::vector<std::vector<neighbor> >& cands)
+    {
+	cands.resize(dist.rows());
+	for(Eigen::Index r = 0; r < dist.rows(); ++r)
+	{
+	    std::vector<neighbor>& cand = cands[r];
+	    cand.clear();
+	    for(Eigen::Index c = 0; c < dist.cols(); ++c)
+	    {
+		cand.emplace_back(dist(r, c), first_col + c);
+	    }
+	    if(cand.size() > k)
+	    {
+		std::nth_element(cand.begin(), cand.begin() + k, cand.end());
+		cand.resize(k);
+	    }
+	}
+    };
+
+    for_each_tile([&](std::size_t i, std::size_t j, const Eigen::MatrixXd& dist)
+    {
+	std::vector<std::vector<neighbor> > cands;
+	select(dist, j, cands);
+	merge(i, cands);
+
+	// the mirrored tile below the diagonal
+	if(symmetric && i != j)
+	{
+	    select(dist.transpose(), i, cands);
+	    merge(j, cands);
+	}
+    });
+
+    for(std::vector<neighbor>& heap : heaps)
+    {
+	std::sort_heap(heap.begin(), heap.end());
+    }
+
+    return heaps;
+}
+
+sparse_dist tiled_dist::within(double max_dist) const
+{
+    // the pairs within max_dist of each row, one lock for each tile of rows
+    std::vector<std::vector<neighbor> > pairs(rows());
+    std::vector<std::mutex> locks((rows() + tile_len - 1) / tile_len);
+
+    for_each_tile([&](std::size_t i, std::size_t j, const Eigen::MatrixXd& dist)
+    {
+	std::vector<std::vector<neighbor> > found(dist.rows());
+	for(Eigen::Index r = 0; r < dist.rows(); ++r)
+	{
+	    // skip the diagonal and below for distances within one file
+	    Eigen::Index c = symmetric ? std::max<long long>(0, i + r + 1 - j) : 0;
+	    for(; c < dist.cols(); ++c)
+	    {
+		if(dist(r, c) <= max_dist)
+		{
+		    found[r].emplace_back(dist(r, c), j + c);
+		}
+	    }
+	}
+
+	std::lock_guard<std::mutex> lock(locks[i / tile_len]);
+	for(std::size_t r = 0; r < found.size(); ++r)
+	{
+	    pairs[i + r].insert(pairs[i + r].end(), found[r].begin(), found[r].end());
+	}
+    });
+
+    sparse_dist sparse(rows(), cols(), max_dist, symmetric ? sparse_dist::UPPER_TRIANGLE : 0);
+    for(std::size_t i = 0; i < rows(); ++i)
+    {
+	std::vector<neighbor>& row = pairs[i];
+	std::sort(row.begin(), row.end(), [](const neighbor& a, const neighbor& b)
+	{
+	    return a.second < b.second;
+	});
+	for(const neighbor& x : row)
+	{
+	    sparse.indices.push_back(x.second);
+	    sparse.data.push_back(x.first);
+	}
+	sparse.indptr[i + 1] = sparse.indices.size();
+	std::vector<neighbor>().swap(row);
+    }
+
+    return sparse;
+}
@@ -0,0 +1,129 @@
+/*
+  Part of SubseqSketch.
+  Pairwise sketching distances computed tile by tile.
+  By Ke @ Penn State
+*/
+
+#ifndef __TILED_DIST_H__
+#define __TILED_DIST_H__
+
+#include "sss_mapped.hpp"
+#include "sparse_dist.hpp"
+#include <string>
+#include <vector>
+#include <utility>
+#include <Eigen/Dense>
+#include <omp.h>
+
+// Cosine distances between the rows of two mapped sketching files, split
+// into tile x tile blocks so that the whole distance matrix never has to
+// be in memory. The norms of all rows are computed once, each tile then
+// normalizes its own rows, and the tiles are computed in parallel.
+class tiled_dist
+{
+public:
+    // Distance to and index of a row of the second file.
+    typedef std::pair<double, std::size_t> neighbor;
+
+    // Arithmetic of the dot products: double or float matrix products of
+    // the normalized rows, or exact products of the integer rows which are
+    // normalized afterwards.
+    enum precision { DOUBLE, FLOAT, INT };
+
+    tiled_dist(const sss_mapped& sketch1, const sss_mapped& sketch2, std::size_t tile,
+	       precision prec = DOUBLE);
+
+    // Distances between the rows of one file. The matrix is symmetric,
+    // only the tiles on and above the diagonal are computed and the
+    // diagonal tiles only compute their upper triangle (as in SYRK).
+    tiled_dist(const sss_mapped& sketch, std::size_t tile, precision prec = DOUBLE);
+
+    // The largest tile size such that each of threads threads can hold the
+    // rows of two tiles and the distances between them within max_bytes.
+    static std::size_t tile_size(std::size_t sketch_len, std::size_t max_bytes, int threads);
+
+    // The largest tile size giving at least 2 tiles per thread (of the
+    // upper triangle if symmetric), the matrix products of a tile run on
+    // one thread. Tiles are kept to at least 64 rows, small inputs may be
+    // a single tile.
+    static std::size_t parallel_tile_size(std::size_t rows, std::size_t cols,
+					  bool symmetric, int threads);
+
+    std::size_t rows() const { return sketch1.rows(); }
+    std::size_t cols() const { return sketch2.rows(); }
+    std::size_t tile() const { return tile_len; }
+
+    // Compute the distances of all tiles in parallel, call
+    // f(first_row, first_col, dist) for each of them where dist is the
+    // matrix of distances of the tile. f is called concurrently from
+    // several threads. For distances within one file only the tiles with
+    // first_row <= first_col are visited.
+    template<typename F>
+    void for_each_tile(F f) const;
+
+    // Write the distances to dist_file in the format of
+    // sss_array::save_dist_matrix, each tile is written to its place in the
+    // file as soon as it is computed.
+    void save(const std::string& dist_file) const;
+
+    // Write the upper triangle (without the diagonal) of the distances
+    // within one file to dist_file as a 1-d npy array, in the condensed
+    // order of scipy.spatial.distance.pdist.
+    void save_condensed(const std::string& dist_file) const;
+
+    // The k nearest rows of the second file for each row of the first
+    // file, sorted by distance (ties by index). Each tile only passes its
+    // own k nearest candidates per row to a bounded heap, the distance
+    // matrix is never held in memory.
+    std::vector<std::vector<neighbor> > nearest(std::size_t k) const;
+
+    // All the distances not larger than max_dist, for distances within
+    // one file only the pairs above the diagonal are kept.
+    sparse_dist within(double max_dist) const;
+
+private:
+    const sss_mapped& sketch1;
+    const sss_mapped& sketch2;
+    std::size_t tile_len;
+    bool symmetric;
+    precision prec;
+
+    // Row norms of sketch1 and sketch2 for the integer dot products, zero
+    // norms are replaced by 1.
+    Eigen::VectorXd norms1;
+    Eigen::VectorXd norms2;
+
+    static Eigen::VectorXd row_norms(const sss_mapped& sketch, std::size_t tile);
+
+    // Fall back to DOUBLE if the integer dot products may overflow.
+    void check_precision();
+
+    void compute_tile(std::size_t i, std::size_t j, Eigen::MatrixXd& dist) const;
+    void compute_float_tile(std::size_t i, std::size_t j, Eigen::MatrixXd& dist) const;
+    void compute_int_tile(std::size_t i, std::size_t j, Eigen::MatrixXd& dist) const;
+};
+
+
+template<typename F>
+void tiled_dist::for_each_tile(F f) const
+{
+    std::size_t row_tiles = (rows() + tile_len - 1) / tile_len;
+    std::size_t col_tiles = (cols() + tile_len - 1) / tile_len;
+    long long num_tiles = row_tiles * col_tiles;
+
+#pragma omp parallel
+    {
+	Eigen::MatrixXd dist;
+#pragma omp for schedule(dynamic, 1)
+	for(long long t = 0; t < num_tiles; ++t)
+	{
+	    std::size_t i = (t / col_tiles) * tile_len;
+	    std::size_t j = (t % col_tiles) * tile_len;
+	    if(symmetric && i > j) continue;
+	    compute_tile(i, j, dist);
+	    f(i, j, static_cast<const Eigen::MatrixXd&>(dist));
+	}
+    }
+}
+
+#endif
@@ -1,32 +1,87 @@
+/*
+  Part of SubseqSketch.
+  Index of a string for fast (tokenized) subsequence searching.
+  By Ke @ Penn State
+*/
+
 #include "tokenized_sequence.hpp"
+#include <limits>
+#include <algorithm>
 
-// TODO: consider using rolling hash if this is too slow
-tokenized_sequence::tokenized_sequence(const std::string& seq, int token_len)
-    : token_len(token_len)
+tokenized_sequence::tokenized_sequence(const std::string& seq,
+				       const subsequences& subs)
+    : subs(subs)
 {
-    int64_t len = seq.size() - token_len + 1;
-    for(int64_t i = 0; i < len; ++i)
+    build(seq);
+}
+
+tokenized_sequence::tokenized_sequence(const packed_sequence& seq,
+				       const subsequences& subs)
+    : subs(subs)
+{
+    build(seq);
+}
+
+template<typename Seq>
+void tokenized_sequence::build(const Seq& seq)
+{
+    if(seq.size() <= std::numeric_limits<uint32_t>::max())
     {
-	auto result = index.emplace(seq.substr(i, token_len),
-				    std::vector<int64_t>(1, i));
-	// string exists in index, append index i
-	if(!result.second)
-	{
-	    result.first->second.push_back(i);
-	}
-	
+	build(seq, positions32);
+    }
+    else
+    {
+	build(seq, positions64);
     }
 }
 
-int tokenized_sequence::longest_subsequence(const std::string& test) const
+template<typename Seq, typename P>
+void tokenized_sequence::build(const Seq& seq, std::vector<P>& positions)
+{
+    // count the occurrences of each token, then fill them in a second pass
+    offsets.assign(subs.num_distinct_tokens + 1, 0);
+    subs.for_each_token(seq, [&](size_t, int id)
+    {
+	++offsets[id + 1];
+	return true;
+    });
+
+    for(int i = 0; i < subs.num_distinct_tokens; ++i)
+    {
+	offsets[i + 1] += offsets[i];
+    }
+
+    positions.resize(offsets.back());
+    std::vector<std::size_t> next(offsets.begin(), offsets.end() - 1);
+    subs.for_each_token(seq, [&](size_t pos, int id)
+    {
+	positions[next[id]++] = pos;
+	return true;
+    });
+}
+
+int tokenized_sequence::longest_subsequence(int j) const
+{
+    if(positions64.empty())
+    {
+	return longest_subsequence(j, positions32);
+    }
+    else
+    {
+	return longest_subsequence(j, positions64);
+    }
+}
+
+template<typename P>
+int tokenized_sequence::longest_subsequence(int j, const std::vector<P>& positions) const
 {
     int result = 0;
     int64_t p = -1;
 
-    // assumes test.size is a multiple of token_len
-    for(int i = 0; i < test.size(); i += token_len)
+    const int* tokens = subs.token_ids.data() + j * subs.num_tokens;
+    for(int i = 0; i < subs.num_tokens; ++i)
     {
-	p = find(test.substr(i, token_len), p);
+	p = find(tokens[i], p, positions);
 	if(p < 0)
 	{
 	    break;
@@ -36,39 +91,43 @@ int tokenized_sequence::longest_subsequence(const std::string& test) const
 	    result += 1;
 	}
     }
-    
+
     return result;
 }
 
-int64_t tokenized_sequence::find(const std::string& token, int64_t st_pos) const
+template<typename P>
+int64_t tokenized_sequence::find(int id, int64_t st_pos,
+				 const std::vector<P>& positions) const
 {
-    auto it = index.find(token);
-    if(it == index.end()) return -1;
+    std::size_t lo = offsets[id];
+    std::size_t hi = offsets[id + 1];
+
+    if(lo == hi || static_cast<int64_t>(positions[hi - 1]) <= st_pos) return -1;
+    if(static_cast<int64_t>(positions[lo]) > st_pos) return positions[lo];
 
-    const std::vector<int64_t>& positions = it->second;
+    // gallop until positions[lo + step] > st_pos, then do binary search on
+    // (lo, lo + step] to find the smallest value > st_pos
+    std::size_t step = 1;
+    while(lo + step < hi && static_cast<int64_t>(positions[lo + step]) <= st_pos)
+    {
+	lo += step;
+	step <<= 1;
+    }
 
-    int64_t result;
-    
-    if(positions.front() > st_pos) result =  positions[0];
-    else if(positions.back() <= st_pos) result = -1;
-    else // do binary search on positions to find smallest value > st_pos
+    std::size_t i = lo + 1;
+    std::size_t k = std::min(lo + step, hi - 1);
+    while(i < k)
     {
-	int i = 1;
-	int j = positions.size() - 1;
-	while(i < j)
+	std::size_t m = (i + k) >> 1;
+	if(static_cast<int64_t>(positions[m]) > st_pos)
 	{
-	    int m = (i + j) >> 1;
-	    if(positions[m] > st_pos)
-	    {
-		j = m;
-	    }
-	    else
-	    {
-		i = m + 1;
-	    }
+	    k = m;
+	}
+	else
+	{
+	    i = m + 1;
 	}
-	result = positions[i];
     }
 
-    return result;
+    return positions[i];
 }
@@ -7,29 +7,44 @@
 #ifndef __TOKENIZED_SEQUENCE_H__
 #define __TOKENIZED_SEQUENCE_H__
 
-#include <unordered_map>
 #include <vector>
 #include <string>
 #include <cstdint>
+#include "subsequences.hpp"
 
 class tokenized_sequence
 {
 public:
-    tokenized_sequence(const std::string& seq, int token_len);
+    // Index the occurrences of the tokens of subs in seq.
+    tokenized_sequence(const std::string& seq, const subsequences& subs);
+    tokenized_sequence(const packed_sequence& seq, const subsequences& subs);
     // Return the maximum number of consecutive tokens (starting from the
-    // leftmost one) in test that form a subsequence (of tokens) of this
-    // underlying sequence.
-    int longest_subsequence(const std::string& test) const;
+    // leftmost one) in subs.seqs[j] that form a subsequence (of tokens) of
+    // this underlying sequence.
+    int longest_subsequence(int j) const;
 private:
-    int token_len;
-    // For each token appears in the underlying sequence, the indices of its
-    // occurrences are stored in ascending order in the corresponding vector.
-    std::unordered_map<std::string, std::vector<int64_t> > index;
+    const subsequences& subs;
+    // The index is stored in CSR layout: the occurrences of the token with
+    // id t are positions[offsets[t] .. offsets[t+1]) in ascending order.
+    // Only one of the position arrays is used, 32-bit positions are used
+    // whenever the sequence is short enough.
+    std::vector<std::size_t> offsets;
+    std::vector<uint32_t> positions32;
+    std::vector<uint64_t> positions64;
 
-    // Search if token appears in the underlying string starting from st_pos+1.
-    // If found, return the beginning index of that occurrence, otherwise
-    // return -1.
-    int64_t find(const std::string& token, int64_t st_pos) const;
+    template<typename Seq>
+    void build(const Seq& seq);
+    template<typename Seq, typename P>
+    void build(const Seq& seq, std::vector<P>& positions);
+
+    template<typename P>
+    int longest_subsequence(int j, const std::vector<P>& positions) const;
+
+    // Search if the token with the given id appears in the underlying string
+    // starting from st_pos+1 with galloping search. If found, return the
+    // beginning index of that occurrence, otherwise return -1.
+    template<typename P>
+    int64_t find(int id, int64_t st_pos, const std::vector<P>& positions) const;
 };
 
 #endif